@@ -18,6 +18,7 @@ namespace bigtext
             "List of commands:\n"
             "\n"
             "   count      Count the number of lines in the files.\n"
+            "   index      Build the line index of the files.\n"
             "   sample     Sample lines from the files.\n"
             "   vocab      Count the words in the files.\n"
             "   version    Show the version info.\n";
@@ -61,6 +62,10 @@ namespace bigtext
                 {
                     return count_command(argc - 1, argv + 1);
                 }
+                else if (command_name == L"index")
+                {
+                    return index_command(argc - 1, argv + 1);
+                }
                 else if (command_name == L"sample")
                 {
                     return sample_command(argc - 1, argv + 1);
@@ -89,20 +94,12 @@ namespace bigtext
             std::wcerr << "Unknown error" << std::endl;
             return 1;
         }
-        return 0;
-    }
-
-    bool check_input_files(const std::vector<fs::path> &input_file_name_list)
-    {
-        for (auto &file_name : input_file_name_list)
+        catch (const std::ios_base::failure &)
         {
-            if (!fs::is_regular_file(file_name))
-            {
-                std::wcerr << "`" << file_name.wstring() << "' doesn't exist." << std::endl;
-                return false;
-            }
+            std::wcerr << "I/O error" << std::endl;
+            return 1;
         }
-        return true;
+        return 0;
     }
 
     bool check_output_files(const std::vector<fs::path>& output_file_name_list)
@@ -206,4 +203,22 @@ namespace bigtext
             return false;
         }
     }
-}
+
+    int get_default_num_threads()
+    {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : static_cast<int>(n);
+    }
+
+    temp_directory::temp_directory()
+    {
+        path_ = fs::temp_directory_path() / fs::unique_path("bigtext-%%%%-%%%%-%%%%-%%%%");
+        fs::create_directories(path_);
+    }
+
+    temp_directory::~temp_directory()
+    {
+        boost::system::error_code ec;
+        fs::remove_all(path_, ec);
+    }
+}
\ No newline at end of file
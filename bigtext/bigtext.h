@@ -16,15 +16,34 @@ namespace bigtext {
 
     int main(int argc, wchar_t *argv[]);
     int count_command(int argc, wchar_t *argv[]);
+    int index_command(int argc, wchar_t *argv[]);
     int sample_command(int argc, wchar_t *argv[]);
     int vocab_command(int argc, wchar_t *argv[]);
     int version_command(int argc, wchar_t *argv[]);
     std::wstring get_version_string();
-    bool check_input_files(const std::vector<fs::path> &input_file_name_list);
+    bool expand_input_files(std::vector<fs::path> &input_file_name_list, int num_threads);
     bool check_output_files(const std::vector<fs::path> &output_file_name_list);
     bool try_parse_rate(const std::wstring &s, double &rate);
     bool try_parse_number(const std::wstring &s, uintmax_t &number_of_lines);
     uintmax_t get_physical_memory_size();
+    int get_default_num_threads();
+
+    // A unique directory under the temporary directory, which is removed
+    // with its contents on destruction.
+    class temp_directory
+    {
+    public:
+        temp_directory();
+        ~temp_directory();
+
+        temp_directory(const temp_directory &) = delete;
+        temp_directory &operator=(const temp_directory &) = delete;
+
+        const fs::path &path() const { return path_; }
+
+    private:
+        fs::path path_;
+    };
 
     template <typename CharT>
     bool is_new_line(CharT ch)
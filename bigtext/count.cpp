@@ -18,36 +18,107 @@ namespace bigtext
         std::wcout << std::endl;
         std::wcout << " -c         full count mode" << std::endl;
         std::wcout << " -h         show this help message" << std::endl;
-        std::wcout << " INPUTFILE  input file" << std::endl;
+        std::wcout << " -l         show percentiles and histograms of line sizes and tokens" << std::endl;
+        std::wcout << " -t N       use N threads" << std::endl;
+        std::wcout << " -w         count bytes, lines, words and UTF-8 characters like wc" << std::endl;
+        std::wcout << " INPUTFILE  input file, directory, pattern or @LISTFILE" << std::endl;
         return 0;
     }
 
-    template <typename CharT>
-    static void dump_file_stat(const fs::path &file_name)
+    static void dump_line_size_sketch(const fs::path &file_name, const line_size_sketch &sketch)
+    {
+        auto &name = file_name.native();
+        static const std::pair<const wchar_t *, double> PERCENTILE_LIST[] = { { L"P50", 0.5 }, { L"P90", 0.9 }, { L"P99", 0.99 }, { L"P999", 0.999 } };
+        for (auto &percentile : PERCENTILE_LIST)
+        {
+            std::wcout << name << "\tLineSize" << percentile.first << "\t" << sketch.size_histogram.percentile(percentile.second) << std::endl;
+        }
+        for (auto &percentile : PERCENTILE_LIST)
+        {
+            std::wcout << name << "\tTokenCount" << percentile.first << "\t" << sketch.token_histogram.percentile(percentile.second) << std::endl;
+        }
+        // Each row has the first value of the range and the count.
+        sketch.size_histogram.for_each_power_of_two([&name](uintmax_t first, uintmax_t count)
+        {
+            std::wcout << name << "\tLineSizeHistogram\t" << first << "\t" << count << std::endl;
+        });
+        sketch.token_histogram.for_each_power_of_two([&name](uintmax_t first, uintmax_t count)
+        {
+            std::wcout << name << "\tTokenCountHistogram\t" << first << "\t" << count << std::endl;
+        });
+    }
+
+    static void dump_text_count(const fs::path &file_name, const text_count &count)
+    {
+        std::wcout << file_name.native() << "\tByteCount\t" << count.byte_count << std::endl;
+        std::wcout << file_name.native() << "\tLineCount\t" << count.line_count << std::endl;
+        std::wcout << file_name.native() << "\tWordCount\t" << count.word_count << std::endl;
+        std::wcout << file_name.native() << "\tCharCount\t" << count.char_count << std::endl;
+        std::wcout << file_name.native() << "\tMalformedCount\t" << count.malformed_count << std::endl;
+    }
+
+    struct file_stat
+    {
+        guess_line_info info;
+        uintmax_t file_size;
+        std::unique_ptr<line_size_sketch> sketch;
+    };
+
+    static void dump_file_stat(const fs::path &file_name, const file_stat &stat)
     {
-        guess_line_info info = file_stat_lines<CharT>(file_name);
+        auto &info = stat.info;
         std::wcout << file_name.native() << "\tMinLineSize\t" << info.min_line_size << std::endl;
         std::wcout << file_name.native() << "\tMaxLineSize\t" << info.max_line_size << std::endl;
         std::wcout << file_name.native() << "\tAvgLineSize\t" << std::fixed << std::setprecision(2) << info.avg_line_size << std::endl;
         std::wcout << file_name.native() << "\tStdLineSize\t" << info.std_line_size << std::endl;
         std::wcout << file_name.native() << "\tUsedLineCount\t" << info.line_count << std::endl;
-        uintmax_t size = fs::file_size(file_name);
-        std::wcout << file_name.native() << "\tFileSize\t" << size << std::endl;
+        std::wcout << file_name.native() << "\tFileSize\t" << stat.file_size << std::endl;
         if (info.is_accurate)
         {
             std::wcout << file_name.native() << "\tEstLineCount\t" << info.line_count << std::endl;
         }
         else
         {
-            double est_line_count = info.avg_line_size == 0 ? 1.0 : (size / sizeof(CharT) / info.avg_line_size);
-            std::wcout << file_name.native() << "\tEstLineCount\t" << est_line_count << std::endl;
+            std::wcout << file_name.native() << "\tEstLineCount\t" << info.est_line_count << std::endl;
+            std::wcout << file_name.native() << "\tEstLineCountLow\t" << std::max(info.est_line_count - info.est_line_count_error, 1.0) << std::endl;
+            std::wcout << file_name.native() << "\tEstLineCountHigh\t" << info.est_line_count + info.est_line_count_error << std::endl;
         }
+        if (stat.sketch)
+        {
+            dump_line_size_sketch(file_name, *stat.sketch);
+        }
+    }
+
+    // Estimates the lines of the files on num_threads threads and outputs
+    // the statistics in the order of the files.
+    template <typename CharT>
+    static void dump_file_stats(const std::vector<fs::path> &input_file_name_list, bool line_size_mode, int num_threads)
+    {
+        auto work_item_list = split_file_work(input_file_name_list, 0, false, num_threads);
+        std::vector<file_stat> stat_list(work_item_list.size());
+        parallel_for_file_work(work_item_list, num_threads, [&input_file_name_list, &stat_list, line_size_mode](int, size_t i)
+        {
+            auto &stat = stat_list[i];
+            if (line_size_mode)
+            {
+                stat.sketch.reset(new line_size_sketch());
+            }
+            stat.info = file_guess_lines<CharT>(input_file_name_list[i], stat.sketch.get());
+            stat.file_size = fs::file_size(input_file_name_list[i]);
+        }, [&input_file_name_list, &stat_list](size_t i)
+        {
+            dump_file_stat(input_file_name_list[i], stat_list[i]);
+            stat_list[i].sketch.reset();
+        });
     }
 
     int count_command(int argc, wchar_t *argv[])
     {
         int optind = 1;
         bool full_count_mode = false;
+        bool line_size_mode = false;
+        bool text_count_mode = false;
+        uintmax_t num_threads = get_default_num_threads();
         std::vector<fs::path> input_file_name_list;
 
         if (argc <= 1)
@@ -61,6 +132,7 @@ namespace bigtext
             if (*p == '-')
             {
                 ++p;
+                bool next_is_number = false;
                 while (*p != '\0')
                 {
                     switch (*p)
@@ -70,11 +142,40 @@ namespace bigtext
                         break;
                     case 'h':
                         return count_usage();
+                    case 'l':
+                        line_size_mode = true;
+                        break;
+                    case 't':
+                        next_is_number = true;
+                        break;
+                    case 'w':
+                        text_count_mode = true;
+                        break;
                     default:
                         std::wcerr << "Unknown option `" << *p << "'." << std::endl;
                         return 1;
                     }
                     ++p;
+
+                    if (next_is_number)
+                    {
+                        if (*p == '\0')
+                        {
+                            if (optind >= argc)
+                            {
+                                std::wcerr << "Number of threads is expected." << std::endl;
+                                return 1;
+                            }
+                            p = argv[optind++];
+                        }
+
+                        if (!try_parse_number(p, num_threads) || num_threads > INT_MAX)
+                        {
+                            std::wcerr << "Invalid number of threads." << std::endl;
+                            return 1;
+                        }
+                        break;
+                    }
                 }
             }
             else
@@ -97,30 +198,72 @@ namespace bigtext
             return 1;
         }
 
-        if (!check_input_files(input_file_name_list))
+        if (!expand_input_files(input_file_name_list, static_cast<int>(num_threads)))
+        {
+            return 1;
+        }
+
+        if (text_count_mode && line_size_mode)
         {
+            std::wcerr << "-l is not allowed with -w." << std::endl;
             return 1;
         }
 
         int status = 0;
+        bool has_total = input_file_name_list.size() > 1;
 
-        for (auto &file_name : input_file_name_list)
+        if (text_count_mode)
         {
-            if (full_count_mode)
+            boost::timer::cpu_timer timer;
+            text_count total_count = {};
+            file_count_text<char>(input_file_name_list, static_cast<int>(num_threads), [&input_file_name_list, &total_count](size_t k, const text_count &count)
+            {
+                dump_text_count(input_file_name_list[k], count);
+                total_count.byte_count += count.byte_count;
+                total_count.line_count += count.line_count;
+                total_count.word_count += count.word_count;
+                total_count.char_count += count.char_count;
+                total_count.malformed_count += count.malformed_count;
+            });
+            std::cerr << timer.format() << std::endl;
+            if (has_total)
             {
-                boost::timer::cpu_timer timer;
-                // 1059203072      404601
-                // 36,762,348,544 bytes.
-                // AMD E2-7110
-                uintmax_t line_count = file_count_lines<char>(file_name);
-                std::cerr << timer.format() << std::endl;
-                std::wcout << file_name.native() << "\tLineCount\t" << line_count << std::endl;
+                dump_text_count(fs::path(), total_count);
             }
-            else
+        }
+        else if (full_count_mode && line_size_mode)
+        {
+            boost::timer::cpu_timer timer;
+            line_size_sketch total_sketch;
+            file_sketch_lines<char>(input_file_name_list, static_cast<int>(num_threads), [&input_file_name_list, &total_sketch](size_t k, const line_size_sketch &sketch)
+            {
+                std::wcout << input_file_name_list[k].native() << "\tLineCount\t" << sketch.size_histogram.count() << std::endl;
+                dump_line_size_sketch(input_file_name_list[k], sketch);
+                total_sketch.merge(sketch);
+            });
+            std::cerr << timer.format() << std::endl;
+            if (has_total)
             {
-                dump_file_stat<char>(file_name);
+                std::wcout << "\tLineCount\t" << total_sketch.size_histogram.count() << std::endl;
+                dump_line_size_sketch(fs::path(), total_sketch);
             }
         }
+        else if (full_count_mode)
+        {
+            boost::timer::cpu_timer timer;
+            // 1059203072      404601
+            // 36,762,348,544 bytes.
+            // AMD E2-7110
+            file_count_lines<char>(input_file_name_list, static_cast<int>(num_threads), [&input_file_name_list](size_t k, uintmax_t line_count)
+            {
+                std::wcout << input_file_name_list[k].native() << "\tLineCount\t" << line_count << std::endl;
+            });
+            std::cerr << timer.format() << std::endl;
+        }
+        else
+        {
+            dump_file_stats<char>(input_file_name_list, line_size_mode, static_cast<int>(num_threads));
+        }
 
         return status;
     }
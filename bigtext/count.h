@@ -5,12 +5,40 @@
 #pragma once
 
 #include "filesource.h"
+#include "filework.h"
+#include "lineindex.h"
+#include "linestat.h"
+#include "parallel.h"
+#include "random.h"
+#include "textcount.h"
+#include "textscan.h"
 
 namespace bigtext
 {
     namespace fs = boost::filesystem;
 
-    static const uintmax_t GUESS_LINE_SIZE = 100 * 1024 * 1024;
+    // Number and bytes of the blocks read to estimate the number of lines.
+    static const size_t GUESS_BLOCK_COUNT = 256;
+    static const size_t GUESS_BLOCK_SIZE = 64 * 1024;
+    // Files up to this size are read to the end and counted exactly.
+    static const uintmax_t GUESS_FULL_SIZE = GUESS_BLOCK_COUNT * GUESS_BLOCK_SIZE;
+    // Two-sided 95% confidence interval.
+    static const double GUESS_CONFIDENCE_Z = 1.96;
+    static const uintmax_t PARALLEL_COUNT_RANGE_SIZE = 64 * 1024 * 1024;
+
+    // BIGTEXT_RANGE_SIZE=BYTES changes the size of the ranges counted on
+    // the threads, which is useful to test small files split into many
+    // ranges.
+    inline uintmax_t parallel_count_range_size()
+    {
+        static const uintmax_t range_size = []
+        {
+            const char *env = std::getenv("BIGTEXT_RANGE_SIZE");
+            uintmax_t size = env != nullptr ? std::strtoull(env, nullptr, 10) : 0;
+            return size > 0 ? size : PARALLEL_COUNT_RANGE_SIZE;
+        }();
+        return range_size;
+    }
 
     template<typename CharT>
     uintmax_t file_count_lines(const fs::path &fname)
@@ -26,18 +54,74 @@ namespace bigtext
             }
             else
             {
-                uintmax_t c = 0;
-                for (size_t i = 0; i < len; i++)
-                {
-                    if (s[i] == '\n') c++;
-                }
-                line_count += c;
+                line_count += count_new_lines(s, len);
                 if (len > 0) last_char = s[len - 1];
             }
         });
         return line_count;
     }
 
+    // Counts the lines of the files on num_threads threads, splitting large
+    // files into byte ranges, and calls report(k, line_count) for each file
+    // k in the order of the files. An up to date index of a file has the
+    // count, so the file is not read.
+    template<typename CharT, typename Report>
+    void file_count_lines(const std::vector<fs::path> &file_name_list, int num_threads, Report report)
+    {
+        struct range_count
+        {
+            uintmax_t line_count;
+            CharT last_char;
+        };
+
+        std::vector<uintmax_t> index_line_count_list(file_name_list.size(), UINTMAX_MAX);
+        parallel_for(file_name_list.size(), num_threads, [&file_name_list, &index_line_count_list](size_t k)
+        {
+            line_index index;
+            if (index.open(file_name_list[k]))
+            {
+                index_line_count_list[k] = index.line_count();
+            }
+        });
+
+        auto work_item_list = split_file_work(file_name_list, parallel_count_range_size(), num_threads > 1, num_threads);
+        std::vector<range_count> range_count_list(work_item_list.size(), range_count{ 0, '\n' });
+        uintmax_t line_count = 0;
+        CharT last_char = '\n';
+        parallel_for_file_work(work_item_list, num_threads, [&work_item_list, &index_line_count_list, &range_count_list](int, size_t i)
+        {
+            auto &item = work_item_list[i];
+            if (index_line_count_list[item.file_index] != UINTMAX_MAX)
+            {
+                return;
+            }
+            auto &result = range_count_list[i];
+            file_work_source(item, [&result](const char *_s, size_t _len)
+            {
+                const CharT *s = reinterpret_cast<const CharT*>(_s);
+                size_t len = _len / sizeof(CharT);
+                if (s != nullptr)
+                {
+                    result.line_count += count_new_lines(s, len);
+                    if (len > 0) result.last_char = s[len - 1];
+                }
+            });
+        }, [&](size_t i)
+        {
+            auto &item = work_item_list[i];
+            line_count += range_count_list[i].line_count;
+            last_char = range_count_list[i].last_char;
+            if (is_last_work_item_of_file(work_item_list, i))
+            {
+                if (last_char != '\n') line_count++;
+                uintmax_t index_line_count = index_line_count_list[item.file_index];
+                report(item.file_index, index_line_count != UINTMAX_MAX ? index_line_count : line_count);
+                line_count = 0;
+                last_char = '\n';
+            }
+        });
+    }
+
     struct guess_line_info
     {
         uintmax_t min_line_size;
@@ -46,71 +130,222 @@ namespace bigtext
         double std_line_size;
         uintmax_t line_count;
         bool is_accurate;
+        double est_line_count;
+        // Half width of the confidence interval of est_line_count.
+        double est_line_count_error;
     };
 
+    // Reads all the lines of the file. The lines are also added to sketch
+    // if it is given.
     template<typename CharT>
-    guess_line_info file_stat_lines(const fs::path &fname)
+    guess_line_info file_stat_lines(const fs::path &fname, line_size_sketch *sketch = nullptr)
     {
-        uintmax_t cur_size = 0;
         uintmax_t total_line_size = 0;
         uintmax_t total_sq_line_size = 0;
-        guess_line_info info = { MAXUINT, 0, 0.0, 0.0, 0, false };
-        file_source_default(fname, [&info, &cur_size, &total_line_size, &total_sq_line_size](const char *_s, size_t _len) {
-            const CharT *s = reinterpret_cast<const CharT*>(_s);
-            size_t len = _len / sizeof(CharT);
-            uintmax_t c = info.line_count;
-            uintmax_t l = cur_size;
-            if (s == nullptr)
+        guess_line_info info = { MAXUINT, 0, 0.0, 0.0, 0, true, 0.0, 0.0 };
+        file_line_source_default<CharT>(fname, [&info, &total_line_size, &total_sq_line_size, sketch](const CharT *s, size_t len)
+        {
+            uintmax_t l = len;
+            if (info.min_line_size > l) info.min_line_size = l;
+            if (info.max_line_size < l) info.max_line_size = l;
+            info.line_count++;
+            total_line_size += l;
+            total_sq_line_size += l * l;
+            if (sketch != nullptr)
             {
-                assert(len == 0);
-                if (l > 0)
+                sketch->add(s, len);
+            }
+        });
+        if (info.line_count == 0)
+        {
+            info.min_line_size = 0;
+        }
+        else if (info.line_count == 1)
+        {
+            info.avg_line_size = static_cast<double>(total_line_size);
+            info.std_line_size = 0.0;
+        }
+        else
+        {
+            info.avg_line_size = static_cast<double>(total_line_size) / info.line_count;
+            double x = static_cast<double>(total_sq_line_size * info.line_count - total_line_size * total_line_size);
+            double y = static_cast<double>(info.line_count * (info.line_count - 1));
+            info.std_line_size = std::sqrt(x / y);
+        }
+        info.est_line_count = static_cast<double>(info.line_count);
+        return info;
+    }
+
+    // Estimates the number of lines from GUESS_BLOCK_COUNT blocks. The file
+    // is split into strata of the same size and the block of each stratum
+    // is at a random offset in it, so that all the parts of a file which
+    // is concatenated from different sources are sampled. The number of
+    // lines of each stratum is estimated by the new lines in its block, and
+    // the variance of the total by the differences of successive strata.
+    // The line sizes are of the lines which are entirely in the blocks.
+    // Those lines are also added to sketch if it is given.
+    template<typename CharT>
+    guess_line_info file_guess_lines(const fs::path &fname, line_size_sketch *sketch = nullptr)
+    {
+        uintmax_t file_size = fs::file_size(fname);
+        if (file_size <= GUESS_FULL_SIZE)
+        {
+            return file_stat_lines<CharT>(fname, sketch);
+        }
+
+        // The blocks only depend on the file size.
+        xoshiro256 gen(file_size);
+        std::vector<file_range> range_list;
+        for (size_t k = 0; k < GUESS_BLOCK_COUNT; k++)
+        {
+            uintmax_t first = file_size * k / GUESS_BLOCK_COUNT;
+            uintmax_t last = file_size * (k + 1) / GUESS_BLOCK_COUNT;
+            uintmax_t offset = first + bounded_random(gen, last - first - GUESS_BLOCK_SIZE + 1);
+            range_list.push_back(file_range{ offset - offset % sizeof(CharT), GUESS_BLOCK_SIZE });
+        }
+        // The last character tells if the last line has its new line.
+        range_list.push_back(file_range{ file_size - sizeof(CharT), sizeof(CharT) });
+
+        uintmax_t total_line_size = 0;
+        uintmax_t total_sq_line_size = 0;
+        bool has_last_new_line = true;
+        std::vector<uintmax_t> new_line_count_list(GUESS_BLOCK_COUNT);
+        guess_line_info info = { MAXUINT, 0, 0.0, 0.0, 0, false, 0.0, 0.0 };
+        bool success = file_batch_range_source(fname, range_list, [&](size_t i, const char *_s, size_t _len)
+        {
+            const CharT *s = reinterpret_cast<const CharT *>(_s);
+            const CharT *last = s + _len / sizeof(CharT);
+            if (i == GUESS_BLOCK_COUNT)
+            {
+                has_last_new_line = s == last || last[-1] == '\n';
+                return;
+            }
+            uintmax_t n = 0;
+            for (const CharT *p = find_new_line(s, last); p != last;)
+            {
+                n++;
+                const CharT *q = find_new_line(p + 1, last);
+                if (q != last)
                 {
+                    uintmax_t l = q - p;
                     if (info.min_line_size > l) info.min_line_size = l;
                     if (info.max_line_size < l) info.max_line_size = l;
-                    c++;
+                    info.line_count++;
                     total_line_size += l;
                     total_sq_line_size += l * l;
-                    l = 0;
-                }
-                info.is_accurate = true;
-            }
-            else
-            {
-                for (size_t i = 0; i < len; i++)
-                {
-                    l++;
-                    if (s[i] == '\n')
+                    if (sketch != nullptr)
                     {
-                        if (info.min_line_size > l) info.min_line_size = l;
-                        if (info.max_line_size < l) info.max_line_size = l;
-                        c++;
-                        total_line_size += l;
-                        total_sq_line_size += l * l;
-                        l = 0;
+                        sketch->add(p + 1, static_cast<size_t>(l));
                     }
                 }
+                p = q;
             }
-            info.line_count = c;
-            cur_size = l;
-        }, GUESS_LINE_SIZE);
-        if (info.line_count == 0)
+            new_line_count_list[i] = n;
+        });
+        if (!success)
         {
-            info.min_line_size = 0;
-            info.avg_line_size = static_cast<double>(cur_size);
-            info.std_line_size = 0.0;
+            return info;
         }
-        else if (info.line_count == 1)
+
+        double block_len = static_cast<double>(GUESS_BLOCK_SIZE / sizeof(CharT));
+        double est_line_count = 0.0;
+        double sq_diff = 0.0;
+        double prev_stratum_count = 0.0;
+        for (size_t k = 0; k < GUESS_BLOCK_COUNT; k++)
         {
-            info.avg_line_size = static_cast<double>(total_line_size);
-            info.std_line_size = 0.0;
+            uintmax_t stratum_size = file_size * (k + 1) / GUESS_BLOCK_COUNT - file_size * k / GUESS_BLOCK_COUNT;
+            double stratum_count = stratum_size / sizeof(CharT) * new_line_count_list[k] / block_len;
+            if (k > 0)
+            {
+                sq_diff += (stratum_count - prev_stratum_count) * (stratum_count - prev_stratum_count);
+            }
+            est_line_count += stratum_count;
+            prev_stratum_count = stratum_count;
         }
-        else
+        if (!has_last_new_line)
+        {
+            est_line_count += 1.0;
+        }
+        double variance = GUESS_BLOCK_COUNT * sq_diff / (2.0 * (GUESS_BLOCK_COUNT - 1));
+        info.est_line_count = std::max(est_line_count, 1.0);
+        info.est_line_count_error = GUESS_CONFIDENCE_Z * std::sqrt(variance);
+
+        info.avg_line_size = file_size / sizeof(CharT) / info.est_line_count;
+        if (info.line_count == 0)
+        {
+            info.min_line_size = 0;
+        }
+        else if (info.line_count > 1)
         {
-            info.avg_line_size = static_cast<double>(total_line_size) / info.line_count;
             double x = static_cast<double>(total_sq_line_size * info.line_count - total_line_size * total_line_size);
             double y = static_cast<double>(info.line_count * (info.line_count - 1));
             info.std_line_size = std::sqrt(x / y);
         }
         return info;
     }
+
+    // Reads all the lines of the files on num_threads threads, splitting
+    // large files into ranges, and calls report(k, sketch) for each file k
+    // in the order of the files with the sketch of its lines.
+    template<typename CharT, typename Report>
+    void file_sketch_lines(const std::vector<fs::path> &file_name_list, int num_threads, Report report)
+    {
+        auto work_item_list = split_file_work(file_name_list, parallel_count_range_size(), num_threads > 1, num_threads);
+        std::vector<std::unique_ptr<line_size_sketch>> range_sketch_list(work_item_list.size());
+        line_size_sketch sketch;
+        parallel_for_file_work(work_item_list, num_threads, [&work_item_list, &range_sketch_list](int, size_t i)
+        {
+            range_sketch_list[i].reset(new line_size_sketch());
+            auto &range_sketch = *range_sketch_list[i];
+            line_source_from<CharT>([&work_item_list, i](data_source_callback f)
+            {
+                file_work_line_range_source<CharT>(work_item_list[i], f);
+            }, [&range_sketch](const CharT *s, size_t len)
+            {
+                range_sketch.add(s, len);
+            });
+        }, [&](size_t i)
+        {
+            sketch.merge(*range_sketch_list[i]);
+            range_sketch_list[i].reset();
+            if (is_last_work_item_of_file(work_item_list, i))
+            {
+                report(work_item_list[i].file_index, sketch);
+                sketch = line_size_sketch();
+            }
+        });
+    }
+
+    // Counts the bytes, lines, words and UTF-8 characters of the files on
+    // num_threads threads, splitting large files into ranges at lines, and
+    // calls report(k, count) for each file k in the order of the files.
+    template<typename CharT, typename Report>
+    void file_count_text(const std::vector<fs::path> &file_name_list, int num_threads, Report report)
+    {
+        static_assert(sizeof(CharT) == sizeof(char), "Only char type is supported.");
+        // No word and no character is split by a range which starts at a
+        // line.
+        auto work_item_list = split_file_work(file_name_list, parallel_count_range_size(), num_threads > 1, num_threads);
+        std::vector<std::unique_ptr<text_counter>> range_counter_list(work_item_list.size());
+        text_counter counter;
+        parallel_for_file_work(work_item_list, num_threads, [&work_item_list, &range_counter_list](int, size_t i)
+        {
+            range_counter_list[i].reset(new text_counter());
+            auto &range_counter = *range_counter_list[i];
+            file_work_line_range_source<CharT>(work_item_list[i], [&range_counter](const char *s, size_t len)
+            {
+                if (s != nullptr) range_counter.update(s, len);
+            });
+        }, [&](size_t i)
+        {
+            counter.merge(*range_counter_list[i]);
+            range_counter_list[i].reset();
+            if (is_last_work_item_of_file(work_item_list, i))
+            {
+                counter.finish();
+                report(work_item_list[i].file_index, counter.count());
+                counter = text_counter();
+            }
+        });
+    }
 }
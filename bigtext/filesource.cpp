@@ -8,13 +8,41 @@
 #include "filesource.h"
 #include <boost/iostreams/device/mapped_file.hpp>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
 namespace bigtext
 {
     namespace fs = boost::filesystem;
 
+#ifdef _WIN32
     static const int NUM_OVERLAPS = 3;
     static const size_t CHUNK_SIZE = 64L * 1024;
     static const size_t CHUNK_SIZE2 = 64L * 1024;
+#else
+    static const int NUM_ASYNC_CHUNKS = 8;
+    static const size_t ASYNC_CHUNK_SIZE = 1024L * 1024;
+    static const size_t ASYNC_ALIGNMENT = 4096;
+    static const size_t CHUNK_SIZE2 = 64L * 1024;
+    // Files smaller than this are read through the page cache, because
+    // they are likely to be read again by the next pass.
+    static const uintmax_t DIRECT_IO_MIN_SIZE = 256LL * 1024 * 1024;
+#endif
 
     void file_source_with_memory_mapping(const fs::path &file_name, data_source_callback callback)
     {
@@ -31,6 +59,7 @@ namespace bigtext
         }
     }
 
+#ifdef _WIN32
     void file_source_with_file_read(const fs::path& file_name, data_source_callback f)
     {
         bool success = false;
@@ -68,7 +97,12 @@ namespace bigtext
         }
     }
 
-    void file_source_with_overlap_read(const fs::path& file_name, data_source_callback callback, uintmax_t max_size)
+    // Reads [first, last) of the file. The reads start from the chunk
+    // boundary before first, and the leading bytes are skipped. If last is
+    // 0, reads to the end of file. If trim_last is false, whole chunks are
+    // passed until the offset reaches last, which is what max_size means.
+    // callback(nullptr, 0) is called only when the end of file is reached.
+    static void overlap_read_range(const fs::path& file_name, data_source_callback callback, uintmax_t first, uintmax_t last, bool trim_last)
     {
         bool success = false;
         LPCWSTR lpfile_name = file_name.native().c_str();
@@ -81,10 +115,11 @@ namespace bigtext
                 OVERLAPPED ol[NUM_OVERLAPS];
                 int process_index = 0;
                 int num_waiting = 0;
-                uintmax_t offset = 0;
+                uintmax_t offset = first - first % CHUNK_SIZE;
+                uintmax_t process_offset = offset;
                 while (true)
                 {
-                    if (num_waiting < NUM_OVERLAPS && (max_size == 0 || offset < max_size))
+                    if (num_waiting < NUM_OVERLAPS && (last == 0 || offset < last))
                     {
                         int read_index = (process_index + num_waiting) % NUM_OVERLAPS;
                         ZeroMemory(&ol[read_index], sizeof ol[read_index]);
@@ -99,8 +134,8 @@ namespace bigtext
                     }
                     if (num_waiting == 0)
                     {
-                        assert(max_size > 0);
-                        assert(offset >= max_size);
+                        assert(last > 0);
+                        assert(offset >= last);
                         success = true;
                         break;
                     }
@@ -127,7 +162,23 @@ namespace bigtext
                         }
                         if (read_bytes == 0)
                             break;
-                        callback(reinterpret_cast<const char *>(buf + process_index * CHUNK_SIZE), read_bytes);
+                        const BYTE *s = buf + process_index * CHUNK_SIZE;
+                        size_t len = read_bytes;
+                        if (process_offset < first)
+                        {
+                            size_t skip = static_cast<size_t>(first - process_offset);
+                            s += std::min(skip, len);
+                            len -= std::min(skip, len);
+                        }
+                        if (trim_last && last > 0 && process_offset + read_bytes > last)
+                        {
+                            len -= std::min(static_cast<size_t>(process_offset + read_bytes - last), len);
+                        }
+                        if (len > 0)
+                        {
+                            callback(reinterpret_cast<const char *>(s), len);
+                        }
+                        process_offset += CHUNK_SIZE;
                         process_index = (process_index + 1) % NUM_OVERLAPS;
                         num_waiting--;
                     }
@@ -146,8 +197,690 @@ namespace bigtext
         }
     }
 
+    void file_source_with_overlap_read(const fs::path& file_name, data_source_callback callback, uintmax_t max_size)
+    {
+        overlap_read_range(file_name, callback, 0, max_size, false);
+    }
+
+#else
+    static void print_posix_error(const fs::path &file_name, int error_code)
+    {
+        std::wcerr << "`" << file_name.wstring() << "': " << std::strerror(error_code) << std::endl;
+    }
+
+    void file_source_with_file_read(const fs::path& file_name, data_source_callback f)
+    {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            print_posix_error(file_name, errno);
+            return;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::unique_ptr<char[]> buf(new char[CHUNK_SIZE2]);
+        while (true)
+        {
+            ssize_t read_bytes = ::read(fd, buf.get(), CHUNK_SIZE2);
+            if (read_bytes < 0)
+            {
+                if (errno == EINTR) continue;
+                print_posix_error(file_name, errno);
+                break;
+            }
+            if (read_bytes == 0)
+            {
+                break;
+            }
+            f(buf.get(), static_cast<size_t>(read_bytes));
+        }
+        ::close(fd);
+    }
+
+    // Keeps up to NUM_ASYNC_CHUNKS reads in flight. Each chunk slot owns
+    // a fixed, aligned region of the buffer. submit() returns false with
+    // errno set if the read is not started. wait() returns the number of
+    // bytes read into the slot, or -errno.
+    class async_chunk_reader
+    {
+    public:
+        virtual ~async_chunk_reader() {}
+        virtual bool submit(int slot, char *buf, size_t size, uintmax_t offset) = 0;
+        virtual ssize_t wait(int slot) = 0;
+    };
+
+    // Completes a read which the kernel returned short before the end of
+    // the file.
+    static ssize_t complete_short_read(int fd, char *buf, size_t size, uintmax_t offset, uintmax_t file_size, ssize_t done)
+    {
+        if (done <= 0) return done;
+        size_t expected = offset >= file_size ? 0 : static_cast<size_t>(std::min<uintmax_t>(size, file_size - offset));
+        while (static_cast<size_t>(done) < expected)
+        {
+            ssize_t n = ::pread(fd, buf + done, expected - done, static_cast<off_t>(offset + done));
+            if (n < 0)
+            {
+                if (errno == EINTR) continue;
+                return -errno;
+            }
+            if (n == 0) break;
+            done += n;
+        }
+        return done;
+    }
+
+    class pread_chunk_reader : public async_chunk_reader
+    {
+    public:
+        pread_chunk_reader(int fd, uintmax_t file_size, int num_threads) : fd_(fd), file_size_(file_size), stopping_(false)
+        {
+            for (int i = 0; i < NUM_ASYNC_CHUNKS; i++)
+            {
+                done_[i] = true;
+                result_[i] = 0;
+            }
+            for (int i = 0; i < num_threads; i++)
+            {
+                thread_list_.emplace_back([this]() { run(); });
+            }
+        }
+
+        ~pread_chunk_reader()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            request_cond_.notify_all();
+            for (auto &t : thread_list_) t.join();
+        }
+
+        bool submit(int slot, char *buf, size_t size, uintmax_t offset) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_[slot] = false;
+                queue_.push_back(request{ slot, buf, size, offset });
+            }
+            request_cond_.notify_one();
+            return true;
+        }
+
+        ssize_t wait(int slot) override
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_cond_.wait(lock, [this, slot]() { return done_[slot]; });
+            return result_[slot];
+        }
+
+    private:
+        struct request
+        {
+            int slot;
+            char *buf;
+            size_t size;
+            uintmax_t offset;
+        };
+
+        void run()
+        {
+            while (true)
+            {
+                request req;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    request_cond_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+                    if (queue_.empty()) return;
+                    req = queue_.front();
+                    queue_.pop_front();
+                }
+                ssize_t n;
+                do
+                {
+                    n = ::pread(fd_, req.buf, req.size, static_cast<off_t>(req.offset));
+                } while (n < 0 && errno == EINTR);
+                n = n < 0 ? -errno : complete_short_read(fd_, req.buf, req.size, req.offset, file_size_, n);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    result_[req.slot] = n;
+                    done_[req.slot] = true;
+                }
+                done_cond_.notify_all();
+            }
+        }
+
+        int fd_;
+        uintmax_t file_size_;
+        bool stopping_;
+        std::mutex mutex_;
+        std::condition_variable request_cond_;
+        std::condition_variable done_cond_;
+        std::deque<request> queue_;
+        std::vector<std::thread> thread_list_;
+        bool done_[NUM_ASYNC_CHUNKS];
+        ssize_t result_[NUM_ASYNC_CHUNKS];
+    };
+
+#ifdef __linux__
+    // io_uring through the raw system calls, so that no liburing is needed.
+    class io_uring_chunk_reader : public async_chunk_reader
+    {
+    public:
+        io_uring_chunk_reader(int fd, uintmax_t file_size) : fd_(fd), file_size_(file_size), ring_fd_(-1),
+            sq_ptr_(MAP_FAILED), cq_ptr_(MAP_FAILED), sqes_(static_cast<io_uring_sqe *>(MAP_FAILED)), sq_size_(0), cq_size_(0), sqes_size_(0), num_pending_(0)
+        {
+            for (int i = 0; i < NUM_ASYNC_CHUNKS; i++)
+            {
+                done_[i] = true;
+                result_[i] = 0;
+            }
+        }
+
+        ~io_uring_chunk_reader()
+        {
+            // The kernel may still write into the buffers. Drain them first.
+            for (int i = 0; i < NUM_ASYNC_CHUNKS; i++)
+            {
+                if (!done_[i] && !reap(i)) break;
+            }
+            if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqes_size_);
+            if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_size_);
+            if (sq_ptr_ != MAP_FAILED) ::munmap(sq_ptr_, sq_size_);
+            if (ring_fd_ >= 0) ::close(ring_fd_);
+        }
+
+        bool setup()
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof params);
+            ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, NUM_ASYNC_CHUNKS, &params));
+            if (ring_fd_ < 0) return false;
+
+            sq_size_ = params.sq_off.array + params.sq_entries * sizeof(__u32);
+            cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single_mmap)
+            {
+                sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+            }
+            sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+            if (sq_ptr_ == MAP_FAILED) return false;
+            if (single_mmap)
+            {
+                cq_ptr_ = sq_ptr_;
+            }
+            else
+            {
+                cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+                if (cq_ptr_ == MAP_FAILED) return false;
+            }
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe *>(::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+            if (sqes_ == MAP_FAILED) return false;
+
+            char *sq = static_cast<char *>(sq_ptr_);
+            char *cq = static_cast<char *>(cq_ptr_);
+            sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+            return true;
+        }
+
+        bool submit(int slot, char *buf, size_t size, uintmax_t offset) override
+        {
+            iov_[slot].iov_base = buf;
+            iov_[slot].iov_len = size;
+            offset_[slot] = offset;
+            unsigned tail = *sq_tail_;
+            unsigned index = tail & sq_mask_;
+            io_uring_sqe *sqe = &sqes_[index];
+            std::memset(sqe, 0, sizeof *sqe);
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd_;
+            sqe->addr = reinterpret_cast<__u64>(&iov_[slot]);
+            sqe->len = 1;
+            sqe->off = offset;
+            sqe->user_data = static_cast<__u64>(slot);
+            sq_array_[index] = index;
+            __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+            int ret;
+            while (true)
+            {
+                ret = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0));
+                if (ret >= 0 || (errno != EINTR && errno != EAGAIN)) break;
+            }
+            // Without a polling thread, the kernel takes the entries only in
+            // io_uring_enter. An entry which it didn't take is withdrawn, so
+            // that no later call submits it after the buffer is reused.
+            if (__atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) != tail + 1)
+            {
+                __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+                // The callers take errno as the error, which is not set
+                // when io_uring_enter succeeded without taking the entry.
+                if (ret >= 0 || errno == 0)
+                {
+                    errno = EIO;
+                }
+                return false;
+            }
+            done_[slot] = false;
+            num_pending_++;
+            return true;
+        }
+
+        ssize_t wait(int slot) override
+        {
+            if (!done_[slot] && !reap(slot)) return -errno;
+            ssize_t n = result_[slot];
+            return complete_short_read(fd_, static_cast<char *>(iov_[slot].iov_base), iov_[slot].iov_len, offset_[slot], file_size_, n);
+        }
+
+    private:
+        bool reap(int slot)
+        {
+            while (!done_[slot])
+            {
+                unsigned head = *cq_head_;
+                unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+                if (head == tail)
+                {
+                    int ret = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+                    if (ret < 0 && errno != EINTR) return false;
+                    continue;
+                }
+                while (head != tail)
+                {
+                    io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+                    int completed = static_cast<int>(cqe->user_data);
+                    result_[completed] = cqe->res;
+                    done_[completed] = true;
+                    num_pending_--;
+                    head++;
+                }
+                __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            }
+            return true;
+        }
+
+        int fd_;
+        uintmax_t file_size_;
+        int ring_fd_;
+        void *sq_ptr_;
+        void *cq_ptr_;
+        io_uring_sqe *sqes_;
+        size_t sq_size_;
+        size_t cq_size_;
+        size_t sqes_size_;
+        unsigned *sq_head_;
+        unsigned *sq_tail_;
+        unsigned sq_mask_;
+        unsigned *sq_array_;
+        unsigned *cq_head_;
+        unsigned *cq_tail_;
+        unsigned cq_mask_;
+        io_uring_cqe *cqes_;
+        int num_pending_;
+        iovec iov_[NUM_ASYNC_CHUNKS];
+        uintmax_t offset_[NUM_ASYNC_CHUNKS];
+        bool done_[NUM_ASYNC_CHUNKS];
+        ssize_t result_[NUM_ASYNC_CHUNKS];
+    };
+#endif
+
+    static std::unique_ptr<async_chunk_reader> create_async_chunk_reader(int fd, uintmax_t file_size)
+    {
+#ifdef __linux__
+        if (std::getenv("BIGTEXT_NO_IO_URING") == nullptr)
+        {
+            std::unique_ptr<io_uring_chunk_reader> reader(new io_uring_chunk_reader(fd, file_size));
+            if (reader->setup())
+            {
+                return reader;
+            }
+        }
+#endif
+        return std::unique_ptr<async_chunk_reader>(new pread_chunk_reader(fd, file_size, NUM_ASYNC_CHUNKS / 2));
+    }
+
+    struct aligned_free
+    {
+        void operator()(char *p) const { std::free(p); }
+    };
+
+    // Same as overlap_read_range on Windows.
+    static void async_read_range(const fs::path& file_name, data_source_callback callback, uintmax_t first, uintmax_t last, bool trim_last)
+    {
+        struct stat st;
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0 || ::fstat(fd, &st) != 0)
+        {
+            print_posix_error(file_name, errno);
+            if (fd >= 0) ::close(fd);
+            return;
+        }
+        uintmax_t file_size = static_cast<uintmax_t>(st.st_size);
+
+#ifdef O_DIRECT
+        // Bypass the page cache for a full scan of a large file, as
+        // FILE_FLAG_NO_BUFFERING does on Windows. Not all file systems
+        // support it, so fall back to the buffered descriptor.
+        if (last == 0 && file_size - std::min(first, file_size) >= DIRECT_IO_MIN_SIZE)
+        {
+            int direct_fd = ::open(file_name.c_str(), O_RDONLY | O_DIRECT);
+            if (direct_fd >= 0)
+            {
+                ::close(fd);
+                fd = direct_fd;
+            }
+        }
+        if ((::fcntl(fd, F_GETFL) & O_DIRECT) == 0)
+#endif
+        {
+            ::posix_fadvise(fd, first, last == 0 ? 0 : last - first, POSIX_FADV_SEQUENTIAL);
+        }
+
+        char *p = nullptr;
+        if (::posix_memalign(reinterpret_cast<void **>(&p), ASYNC_ALIGNMENT, NUM_ASYNC_CHUNKS * ASYNC_CHUNK_SIZE) != 0)
+        {
+            print_posix_error(file_name, ENOMEM);
+            ::close(fd);
+            return;
+        }
+        std::unique_ptr<char, aligned_free> buf(p);
+
+        bool success = false;
+        int error_code = 0;
+        {
+            std::unique_ptr<async_chunk_reader> reader = create_async_chunk_reader(fd, file_size);
+            int process_index = 0;
+            int num_waiting = 0;
+            uintmax_t offset = first - first % ASYNC_CHUNK_SIZE;
+            uintmax_t process_offset = offset;
+            while (true)
+            {
+                while (num_waiting < NUM_ASYNC_CHUNKS && (last == 0 || offset < last) && offset <= file_size)
+                {
+                    int read_index = (process_index + num_waiting) % NUM_ASYNC_CHUNKS;
+                    if (!reader->submit(read_index, buf.get() + read_index * ASYNC_CHUNK_SIZE, ASYNC_CHUNK_SIZE, offset))
+                    {
+                        error_code = errno;
+                        break;
+                    }
+                    offset += ASYNC_CHUNK_SIZE;
+                    num_waiting++;
+                }
+                if (error_code != 0)
+                {
+                    break;
+                }
+                if (num_waiting == 0)
+                {
+                    assert(last > 0);
+                    assert(offset >= last);
+                    success = true;
+                    break;
+                }
+
+                ssize_t read_bytes = reader->wait(process_index);
+                if (read_bytes < 0)
+                {
+                    error_code = static_cast<int>(-read_bytes);
+                    break;
+                }
+                assert(static_cast<size_t>(read_bytes) <= ASYNC_CHUNK_SIZE);
+                const char *s = buf.get() + process_index * ASYNC_CHUNK_SIZE;
+                size_t len = static_cast<size_t>(read_bytes);
+                if (process_offset < first)
+                {
+                    size_t skip = static_cast<size_t>(first - process_offset);
+                    s += std::min(skip, len);
+                    len -= std::min(skip, len);
+                }
+                if (trim_last && last > 0 && process_offset + read_bytes > last)
+                {
+                    len -= std::min(static_cast<size_t>(process_offset + read_bytes - last), len);
+                }
+                if (len > 0)
+                {
+                    callback(s, len);
+                }
+                if (static_cast<size_t>(read_bytes) < ASYNC_CHUNK_SIZE)
+                {
+                    // A short read is the end of file. The reads still in
+                    // flight are drained when the reader is destroyed.
+                    callback(nullptr, 0);
+                    success = true;
+                    break;
+                }
+                process_offset += ASYNC_CHUNK_SIZE;
+                process_index = (process_index + 1) % NUM_ASYNC_CHUNKS;
+                num_waiting--;
+            }
+        }
+        ::close(fd);
+        if (!success)
+        {
+            print_posix_error(file_name, error_code);
+        }
+    }
+
+    void file_source_with_async_read(const fs::path& file_name, data_source_callback callback, uintmax_t max_size)
+    {
+        async_read_range(file_name, callback, 0, max_size, false);
+    }
+#endif
+
     void file_source_default(const fs::path& file_name, data_source_callback callback, uintmax_t max_size)
     {
+#ifdef _WIN32
         file_source_with_overlap_read(file_name, callback, max_size);
+#else
+        file_source_with_async_read(file_name, callback, max_size);
+#endif
+    }
+
+#ifdef _WIN32
+    bool file_batch_range_source(const fs::path &file_name, const std::vector<file_range> &range_list, range_data_callback callback)
+    {
+        if (range_list.empty())
+        {
+            return true;
+        }
+        LPCWSTR lpfile_name = file_name.native().c_str();
+        HANDLE h_file = CreateFileW(lpfile_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (h_file == INVALID_HANDLE_VALUE)
+        {
+            std::wcerr << __wcserror(file_name.native().c_str());
+            return false;
+        }
+        size_t slot_size = 0;
+        for (auto &range : range_list) slot_size = std::max(slot_size, range.size);
+        std::vector<BYTE> buf(NUM_OVERLAPS * std::max<size_t>(slot_size, 1));
+        OVERLAPPED ol[NUM_OVERLAPS];
+        for (int i = 0; i < NUM_OVERLAPS; i++)
+        {
+            ZeroMemory(&ol[i], sizeof ol[i]);
+            ol[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        }
+
+        bool success = true;
+        size_t next_index = 0;
+        size_t i = 0;
+        for (; i < range_list.size(); i++)
+        {
+            // Keeps NUM_OVERLAPS reads in flight.
+            while (next_index < range_list.size() && next_index < i + NUM_OVERLAPS)
+            {
+                int read_index = static_cast<int>(next_index % NUM_OVERLAPS);
+                uintmax_t offset = range_list[next_index].offset;
+                ResetEvent(ol[read_index].hEvent);
+                ol[read_index].Offset = static_cast<DWORD>(offset);
+                ol[read_index].OffsetHigh = static_cast<DWORD>(offset >> 32);
+                if (!ReadFile(h_file, &buf[read_index * slot_size], static_cast<DWORD>(range_list[next_index].size), NULL, &ol[read_index])
+                    && GetLastError() != ERROR_IO_PENDING)
+                {
+                    success = false;
+                    break;
+                }
+                next_index++;
+            }
+            if (!success)
+            {
+                break;
+            }
+            int process_index = static_cast<int>(i % NUM_OVERLAPS);
+            DWORD read_bytes = 0;
+            if (!GetOverlappedResult(h_file, &ol[process_index], &read_bytes, TRUE))
+            {
+                if (GetLastError() != ERROR_HANDLE_EOF)
+                {
+                    success = false;
+                    break;
+                }
+                read_bytes = 0;
+            }
+            callback(i, reinterpret_cast<const char *>(&buf[process_index * slot_size]), read_bytes);
+        }
+        if (!success)
+        {
+            std::wcerr << __wcserror(file_name.native().c_str());
+            // The buffers must outlive the reads still in flight.
+            CancelIo(h_file);
+            for (; i < next_index; i++)
+            {
+                DWORD read_bytes;
+                GetOverlappedResult(h_file, &ol[i % NUM_OVERLAPS], &read_bytes, TRUE);
+            }
+        }
+        for (int j = 0; j < NUM_OVERLAPS; j++)
+        {
+            CloseHandle(ol[j].hEvent);
+        }
+        CloseHandle(h_file);
+        return success;
+    }
+#else
+    bool file_batch_range_source(const fs::path &file_name, const std::vector<file_range> &range_list, range_data_callback callback)
+    {
+        if (range_list.empty())
+        {
+            return true;
+        }
+        struct stat st;
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0 || ::fstat(fd, &st) != 0)
+        {
+            print_posix_error(file_name, errno);
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+        size_t slot_size = ASYNC_ALIGNMENT;
+        for (auto &range : range_list) slot_size = std::max(slot_size, range.size);
+        slot_size = (slot_size + ASYNC_ALIGNMENT - 1) / ASYNC_ALIGNMENT * ASYNC_ALIGNMENT;
+        char *p = nullptr;
+        if (::posix_memalign(reinterpret_cast<void **>(&p), ASYNC_ALIGNMENT, NUM_ASYNC_CHUNKS * slot_size) != 0)
+        {
+            print_posix_error(file_name, ENOMEM);
+            ::close(fd);
+            return false;
+        }
+        std::unique_ptr<char, aligned_free> buf(p);
+
+        int error_code = 0;
+        {
+            std::unique_ptr<async_chunk_reader> reader = create_async_chunk_reader(fd, static_cast<uintmax_t>(st.st_size));
+            size_t next_index = 0;
+            for (size_t i = 0; i < range_list.size(); i++)
+            {
+                // Keeps NUM_ASYNC_CHUNKS reads in flight.
+                while (next_index < range_list.size() && next_index < i + NUM_ASYNC_CHUNKS)
+                {
+                    int read_index = static_cast<int>(next_index % NUM_ASYNC_CHUNKS);
+                    if (!reader->submit(read_index, buf.get() + read_index * slot_size, range_list[next_index].size, range_list[next_index].offset))
+                    {
+                        error_code = errno;
+                        break;
+                    }
+                    next_index++;
+                }
+                if (error_code != 0)
+                {
+                    break;
+                }
+                int process_index = static_cast<int>(i % NUM_ASYNC_CHUNKS);
+                ssize_t read_bytes = reader->wait(process_index);
+                if (read_bytes < 0)
+                {
+                    error_code = static_cast<int>(-read_bytes);
+                    break;
+                }
+                callback(i, buf.get() + process_index * slot_size, static_cast<size_t>(read_bytes));
+            }
+        }
+        ::close(fd);
+        if (error_code != 0)
+        {
+            print_posix_error(file_name, error_code);
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    void prefetch_memory(const void *p, size_t size)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+#ifdef _WIN32
+        WIN32_MEMORY_RANGE_ENTRY entry;
+        entry.VirtualAddress = const_cast<void *>(p);
+        entry.NumberOfBytes = size;
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+#else
+        static const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t first = reinterpret_cast<uintptr_t>(p) & ~(page_size - 1);
+        uintptr_t last = reinterpret_cast<uintptr_t>(p) + size;
+        posix_madvise(reinterpret_cast<void *>(first), last - first, POSIX_MADV_WILLNEED);
+#endif
+    }
+
+    bool is_memory_resident(const void *p, size_t size)
+    {
+#ifdef _WIN32
+        // Checking the working set costs as much as prefetching.
+        return false;
+#else
+        static const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t first = reinterpret_cast<uintptr_t>(p) & ~(page_size - 1);
+        uintptr_t last = reinterpret_cast<uintptr_t>(p) + size;
+        size_t num_pages = static_cast<size_t>((last - first + page_size - 1) / page_size);
+        std::vector<unsigned char> page_list(num_pages);
+        if (mincore(reinterpret_cast<void *>(first), last - first, page_list.data()) != 0)
+        {
+            return false;
+        }
+        return std::all_of(page_list.begin(), page_list.end(), [](unsigned char x) { return (x & 1) != 0; });
+#endif
+    }
+
+    void file_range_source_default(const fs::path& file_name, uintmax_t offset, uintmax_t size, data_source_callback callback)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+#ifdef _WIN32
+        overlap_read_range(file_name, callback, offset, offset + size, true);
+#else
+        async_read_range(file_name, callback, offset, offset + size, true);
+#endif
     }
 }
\ No newline at end of file
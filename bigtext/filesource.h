@@ -4,24 +4,60 @@
 
 #pragma once
 
+#include "textscan.h"
+
 namespace bigtext
 {
     namespace fs = boost::filesystem;
 
     using data_source_callback = std::function<void(const char *, size_t)>;
 
+    static const uintmax_t LINE_TAIL_READ_SIZE = 1024 * 1024;
+
     void file_source_with_memory_mapping(const fs::path &file_name, data_source_callback callback);
     void file_source_with_file_read(const fs::path &file_name, data_source_callback callback);
+#ifdef _WIN32
     void file_source_with_overlap_read(const fs::path &file_name, data_source_callback callback, uintmax_t max_size = 0);
+#else
+    void file_source_with_async_read(const fs::path &file_name, data_source_callback callback, uintmax_t max_size = 0);
+#endif
     void file_source_default(const fs::path &file_name, data_source_callback callback, uintmax_t max_size = 0);
+    // Reads exactly the bytes in [offset, offset + size). callback(nullptr, 0)
+    // is called only when the range reaches the end of file.
+    void file_range_source_default(const fs::path &file_name, uintmax_t offset, uintmax_t size, data_source_callback callback);
 
-    template <typename CharT>
-    void file_line_source_default(const fs::path &file_name, std::function<void(const CharT *, size_t)> callback)
+    struct file_range
+    {
+        uintmax_t offset;
+        size_t size;
+    };
+
+    using range_data_callback = std::function<void(size_t, const char *, size_t)>;
+
+    // Reads the ranges of the file with several positioned reads in flight
+    // and calls callback(i, s, len) for each range i in the order of the
+    // list. len is less than the size of the range at the end of file.
+    // Sorting the ranges by offset turns random reads into a near
+    // sequential sweep. Returns false after printing the error.
+    bool file_batch_range_source(const fs::path &file_name, const std::vector<file_range> &range_list, range_data_callback callback);
+
+    // Asks the OS to read the pages of mapped memory in the background.
+    void prefetch_memory(const void *p, size_t size);
+    // Returns true if all the pages of mapped memory are in memory.
+    bool is_memory_resident(const void *p, size_t size);
+
+    // The line and word sources take the callback as a template parameter,
+    // so that the per line or per word callback is inlined into the scan
+    // loop. Only the per chunk data_source_callback is a std::function.
+
+    // Calls callback(s, len) for each line with its new line in the data
+    // from source, which is called with the data_source_callback.
+    template <typename CharT, typename Source, typename Callback>
+    void line_source_from(Source source, Callback callback)
     {
-        uintmax_t line_count = 0;
         std::basic_string<CharT> _previous_partial_line;
 
-        file_source_default(file_name, [&line_count, &_previous_partial_line, callback](const char *_s, size_t _len)
+        source([&_previous_partial_line, &callback](const char *_s, size_t _len)
         {
             const CharT *s = reinterpret_cast<const CharT *>(_s);
             size_t len = _len / sizeof(CharT);
@@ -31,163 +67,312 @@ namespace bigtext
                 if (_previous_partial_line.size() > 0)
                 {
                     callback(_previous_partial_line.data(), _previous_partial_line.size());
+                    _previous_partial_line.clear();
                 }
             }
             else
             {
-                size_t c = 0;
                 const CharT *first = reinterpret_cast<const CharT *>(s);
                 const CharT *last = s + len;
                 const CharT *p = first;
                 const CharT* line_start = p;
                 if (_previous_partial_line.size() > 0)
                 {
-                    while (p != last)
+                    p = find_new_line(p, last);
+                    if (p != last)
                     {
-                        if (is_new_line(*p++))
-                        {
-                            _previous_partial_line.append(first, p);
-                            callback(_previous_partial_line.data(), _previous_partial_line.size());
-                            line_start = p;
-                            c++;
-                            _previous_partial_line.clear();
-                            break;
-                        }
+                        ++p;
+                        _previous_partial_line.append(first, p);
+                        callback(_previous_partial_line.data(), _previous_partial_line.size());
+                        line_start = p;
+                        _previous_partial_line.clear();
                     }
                 }
                 while (p != last)
                 {
-                    if (is_new_line(*p++))
+                    p = find_new_line(p, last);
+                    if (p == last)
                     {
-                        callback(line_start, p - line_start);
-                        line_start = p;
-                        c++;
+                        break;
                     }
+                    ++p;
+                    callback(line_start, p - line_start);
+                    line_start = p;
                 }
                 _previous_partial_line.append(line_start, last);
-                line_count += c;
             }
         });
     }
 
-    template <typename CharT>
-    void file_word_source_default(const fs::path &file_name, std::function<void(const CharT *, size_t)> callback)
+    template <typename CharT, typename Callback>
+    void file_line_source_default(const fs::path &file_name, Callback callback)
     {
-        uintmax_t line_count = 0;
-        std::basic_string<CharT> _previous_partial_line;
+        line_source_from<CharT>([&file_name](data_source_callback f) { file_source_default(file_name, f); }, callback);
+    }
 
-        file_source_default(file_name, [&line_count, &_previous_partial_line, callback](const char *_s, size_t _len)
+    // Reads the lines which start in [offset, offset + size). The last
+    // line is read to its end even if it is beyond the range, so splitting
+    // a file into ranges splits its lines without overlap. callback(nullptr,
+    // 0) is called at the end of the lines. first_line_offset is set to the
+    // byte offset of the first line before callback is called with it.
+    template <typename CharT>
+    void file_line_range_source_default(const fs::path &file_name, uintmax_t offset, uintmax_t size, data_source_callback callback, uintmax_t *first_line_offset = nullptr)
+    {
+        if (first_line_offset != nullptr)
         {
-            const CharT *s = reinterpret_cast<const CharT *>(_s);
-            size_t len = _len / sizeof(CharT);
-
-            if (s == nullptr)
+            *first_line_offset = offset;
+        }
+        uintmax_t file_size = fs::file_size(file_name);
+        uintmax_t last = std::min(offset + size, file_size);
+        if (offset < last)
+        {
+            // The line at offset belongs to the previous range unless the
+            // character before offset is a new line.
+            bool in_previous_line = offset > 0;
+            uintmax_t first = offset > 0 ? offset - sizeof(CharT) : 0;
+            CharT last_char = '\n';
+            uintmax_t skipped = first;
+            file_range_source_default(file_name, first, last - first, [&in_previous_line, &last_char, &callback, &skipped, first_line_offset](const char *_s, size_t _len)
             {
-                if (_previous_partial_line.size() > 0)
+                const CharT *s = reinterpret_cast<const CharT *>(_s);
+                size_t len = _len / sizeof(CharT);
+                if (s == nullptr || len == 0)
                 {
-                    callback(_previous_partial_line.data(), _previous_partial_line.size());
-                    line_count++;
+                    return;
                 }
-            }
-            else
-            {
-                size_t c = 0;
-                const CharT *first = reinterpret_cast<const CharT *>(s);
-                const CharT *last = s + len;
-                const CharT *p = first;
-                if (_previous_partial_line.size() > 0)
+                if (in_previous_line)
                 {
-                    while (p != last)
+                    const CharT *p = find_new_line(s, s + len);
+                    if (p == s + len)
                     {
-                        if (is_white_space(*p++))
-                        {
-                            _previous_partial_line.append(first, p - 1);
-                            callback(_previous_partial_line.data(), _previous_partial_line.size());
-                            c++;
-                            _previous_partial_line.clear();
-                            break;
-                        }
+                        skipped += len * sizeof(CharT);
+                        return;
+                    }
+                    in_previous_line = false;
+                    skipped += (p + 1 - s) * sizeof(CharT);
+                    if (first_line_offset != nullptr)
+                    {
+                        *first_line_offset = skipped;
+                    }
+                    len -= p + 1 - s;
+                    s = p + 1;
+                    if (len == 0)
+                    {
+                        return;
                     }
                 }
-                const CharT* line_start = p;
-                while (p != last)
+                last_char = s[len - 1];
+                callback(reinterpret_cast<const char *>(s), len * sizeof(CharT));
+            });
+
+            uintmax_t pos = last;
+            while (!in_previous_line && !is_new_line(last_char) && pos < file_size)
+            {
+                uintmax_t n = std::min(LINE_TAIL_READ_SIZE, file_size - pos);
+                file_range_source_default(file_name, pos, n, [&last_char, &callback](const char *_s, size_t _len)
+                {
+                    const CharT *s = reinterpret_cast<const CharT *>(_s);
+                    size_t len = _len / sizeof(CharT);
+                    if (s == nullptr || len == 0 || is_new_line(last_char))
+                    {
+                        return;
+                    }
+                    const CharT *p = find_new_line(s, s + len);
+                    if (p != s + len)
+                    {
+                        len = p + 1 - s;
+                    }
+                    last_char = s[len - 1];
+                    callback(_s, len * sizeof(CharT));
+                });
+                pos += n;
+            }
+        }
+        callback(nullptr, 0);
+    }
+
+    // Reads the lines which start in [offset, offset + size).
+    // first_line_offset is set as in file_line_range_source_default.
+    template <typename CharT, typename Callback>
+    void file_line_source_default(const fs::path &file_name, uintmax_t offset, uintmax_t size, Callback callback, uintmax_t *first_line_offset = nullptr)
+    {
+        line_source_from<CharT>([&file_name, offset, size, first_line_offset](data_source_callback f)
+        {
+            file_line_range_source_default<CharT>(file_name, offset, size, f, first_line_offset);
+        }, callback);
+    }
+
+    static const size_t WORD_SCAN_BLOCKS = 64;
+
+    template <typename CharT>
+    struct word_scan_state
+    {
+        std::basic_string<CharT> partial_word;
+        bool in_word;
+
+        word_scan_state() : in_word(false) {}
+    };
+
+    // Calls word_callback(s, len) for each word and separator_callback(ch)
+    // for each column or line separator in the order of the text. Words
+    // are found from the white space bitmasks of each 64 characters. A word
+    // which continues to the next chunk is kept in state.partial_word.
+    template <typename CharT, typename WordCallback, typename SeparatorCallback>
+    void scan_words(word_scan_state<CharT> &state, const CharT *s, size_t len, CharT column_separator, CharT line_separator, bool want_separators,
+        WordCallback word_callback, SeparatorCallback separator_callback)
+    {
+        uint64_t white_space_mask[WORD_SCAN_BLOCKS];
+        uint64_t column_mask[WORD_SCAN_BLOCKS];
+        uint64_t line_mask[WORD_SCAN_BLOCKS];
+        const CharT *word_start = s;
+
+        for (size_t window = 0; window < len; window += WORD_SCAN_BLOCKS * 64)
+        {
+            const CharT *base = s + window;
+            size_t window_len = std::min(len - window, WORD_SCAN_BLOCKS * 64);
+            classify_white_space(base, window_len, column_separator, line_separator, white_space_mask,
+                want_separators ? column_mask : nullptr, want_separators ? line_mask : nullptr);
+
+            for (size_t b = 0; b * 64 < window_len; b++)
+            {
+                size_t n = std::min<size_t>(window_len - b * 64, 64);
+                uint64_t valid = n == 64 ? ~0ULL : (1ULL << n) - 1;
+                uint64_t ws = white_space_mask[b];
+                uint64_t prev_ws = (ws << 1) | (state.in_word ? 0 : 1);
+                uint64_t starts = ~ws & prev_ws & valid;
+                uint64_t ends = ws & ~prev_ws;
+                uint64_t separators = want_separators ? (column_mask[b] | line_mask[b]) & ws : 0;
+                uint64_t events = starts | ends | separators;
+                while (events != 0)
                 {
-                    if (is_white_space(*p++))
+                    int i = count_trailing_zeros(events);
+                    uint64_t bit = 1ULL << i;
+                    events &= events - 1;
+                    const CharT *p = base + b * 64 + i;
+                    if (starts & bit)
+                    {
+                        word_start = p;
+                        continue;
+                    }
+                    if (ends & bit)
                     {
-                        if (p - line_start - 1 > 0)
+                        if (state.partial_word.size() > 0)
                         {
-                            callback(line_start, p - line_start - 1);
-                            c++;
+                            state.partial_word.append(word_start, p);
+                            word_callback(state.partial_word.data(), state.partial_word.size());
+                            state.partial_word.clear();
                         }
-                        line_start = p;
+                        else
+                        {
+                            word_callback(word_start, p - word_start);
+                        }
+                    }
+                    if (separators & bit)
+                    {
+                        separator_callback(*p);
                     }
                 }
-                _previous_partial_line.append(line_start, last);
-                line_count += c;
+                state.in_word = ((ws >> (n - 1)) & 1) == 0;
+            }
+        }
+
+        if (state.in_word)
+        {
+            state.partial_word.append(word_start, s + len);
+        }
+    }
+
+    template <typename CharT, typename WordCallback>
+    void finish_words(word_scan_state<CharT> &state, WordCallback word_callback)
+    {
+        if (state.partial_word.size() > 0)
+        {
+            word_callback(state.partial_word.data(), state.partial_word.size());
+            state.partial_word.clear();
+        }
+        state.in_word = false;
+    }
+
+    // Calls callback(s, len) for each word in the data from source, which
+    // is called with the data_source_callback.
+    template <typename CharT, typename Source, typename Callback>
+    void word_source_from(Source source, Callback callback)
+    {
+        word_scan_state<CharT> state;
+
+        source([&state, &callback](const char *_s, size_t _len)
+        {
+            const CharT *s = reinterpret_cast<const CharT *>(_s);
+            size_t len = _len / sizeof(CharT);
+
+            if (s == nullptr)
+            {
+                finish_words(state, callback);
+            }
+            else
+            {
+                scan_words<CharT>(state, s, len, '\t', '\n', false, std::ref(callback), [](CharT) {});
             }
         });
     }
 
-    template <typename CharT, CharT LINE_SEPARATOR = '\n', CharT COLUMN_SEPARATOR = '\t'>
-    void file_word_source_with_column_default(const fs::path &file_name, std::function<void(const CharT *, size_t, int column)> callback)
+    // Calls callback(s, len, column) for each word in the data from source.
+    template <typename CharT, CharT LINE_SEPARATOR, CharT COLUMN_SEPARATOR, typename Source, typename Callback>
+    void word_source_with_column_from(Source source, Callback callback)
     {
-        uintmax_t line_count = 0;
-        std::basic_string<CharT> _previous_partial_line;
+        word_scan_state<CharT> state;
         int column = 0;
 
-        file_source_default(file_name, [&line_count, &_previous_partial_line, &column, callback](const char *_s, size_t _len)
+        source([&state, &column, &callback](const char *_s, size_t _len)
         {
             const CharT *s = reinterpret_cast<const CharT *>(_s);
             size_t len = _len / sizeof(CharT);
 
             if (s == nullptr)
             {
-                if (_previous_partial_line.size() > 0)
-                {
-                    callback(_previous_partial_line.data(), _previous_partial_line.size(), column);
-                    line_count++;
-                }
+                finish_words(state, [&column, &callback](const CharT *s, size_t len) { callback(s, len, column); });
             }
             else
             {
-                size_t c = 0;
-                const CharT *last = reinterpret_cast<const CharT *>(s + len);
-                const CharT *p = reinterpret_cast<const CharT *>(s);
-                const CharT* line_start = p;
-
-                while (p != last)
+                scan_words<CharT>(state, s, len, COLUMN_SEPARATOR, LINE_SEPARATOR, true,
+                    [&column, &callback](const CharT *s, size_t len) { callback(s, len, column); },
+                    [&column](CharT ch)
                 {
-                    if (is_white_space(*p))
+                    if (ch == LINE_SEPARATOR)
                     {
-                        if (_previous_partial_line.size() > 0)
-                        {
-                            _previous_partial_line.append(line_start, p);
-                            callback(_previous_partial_line.data(), _previous_partial_line.size(), column);
-                            _previous_partial_line.clear();
-                        }
-                        else if (p - line_start > 0)
-                        {
-                            callback(line_start, p - line_start, column);
-                        }
-
-                        if (*p == LINE_SEPARATOR)
-                        {
-                            column = 0;
-                            c++;
-                        }
-                        else if (*p == COLUMN_SEPARATOR)
-                        {
-                            column++;
-                        }
-
-                        line_start = p + 1;
+                        column = 0;
                     }
-
-                    p++;
-                }
-                _previous_partial_line.append(line_start, last);
-                line_count += c;
+                    else
+                    {
+                        column++;
+                    }
+                });
             }
         });
     }
+
+    template <typename CharT, typename Callback>
+    void file_word_source_default(const fs::path &file_name, Callback callback)
+    {
+        word_source_from<CharT>([&file_name](data_source_callback f) { file_source_default(file_name, f); }, callback);
+    }
+
+    // Reads the words in the lines which start in [offset, offset + size).
+    template <typename CharT, typename Callback>
+    void file_word_source_default(const fs::path &file_name, uintmax_t offset, uintmax_t size, Callback callback)
+    {
+        word_source_from<CharT>([&file_name, offset, size](data_source_callback f) { file_line_range_source_default<CharT>(file_name, offset, size, f); }, callback);
+    }
+
+    template <typename CharT, CharT LINE_SEPARATOR = '\n', CharT COLUMN_SEPARATOR = '\t', typename Callback>
+    void file_word_source_with_column_default(const fs::path &file_name, Callback callback)
+    {
+        word_source_with_column_from<CharT, LINE_SEPARATOR, COLUMN_SEPARATOR>([&file_name](data_source_callback f) { file_source_default(file_name, f); }, callback);
+    }
+
+    template <typename CharT, CharT LINE_SEPARATOR = '\n', CharT COLUMN_SEPARATOR = '\t', typename Callback>
+    void file_word_source_with_column_default(const fs::path &file_name, uintmax_t offset, uintmax_t size, Callback callback)
+    {
+        word_source_with_column_from<CharT, LINE_SEPARATOR, COLUMN_SEPARATOR>([&file_name, offset, size](data_source_callback f) { file_line_range_source_default<CharT>(file_name, offset, size, f); }, callback);
+    }
 }
@@ -0,0 +1,108 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+#include "filesource.h"
+#include "parallel.h"
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    // Work items processed ahead of the first unfinished one for each
+    // thread. Each item being processed has its own asynchronous reads in
+    // flight, so this bounds the files open at a time, and the results
+    // waiting to be reported in order.
+    static const size_t FILE_WORK_WINDOW_PER_THREAD = 2;
+
+    // A whole file or a range of it, processed by a thread at a time. The
+    // items of all the input files are processed on the same threads, so
+    // many small files are read at the same time like the ranges of a
+    // large file.
+    struct file_work_item
+    {
+        const fs::path *file_name;
+        size_t file_index;
+        uintmax_t offset;
+        uintmax_t size; // 0 for the whole file.
+    };
+
+    // True if the item i is the last one of its file.
+    inline bool is_last_work_item_of_file(const std::vector<file_work_item> &work_item_list, size_t i)
+    {
+        return i + 1 == work_item_list.size() || work_item_list[i + 1].file_index != work_item_list[i].file_index;
+    }
+
+    // Splits files larger than range_size into ranges if split is true. The
+    // sizes of the files are read on num_threads threads. The items are in
+    // the order of the files and of the offsets.
+    inline std::vector<file_work_item> split_file_work(const std::vector<fs::path> &input_file_name_list, uintmax_t range_size, bool split, int num_threads)
+    {
+        std::vector<uintmax_t> file_size_list(input_file_name_list.size());
+        if (split)
+        {
+            parallel_for(input_file_name_list.size(), num_threads, [&input_file_name_list, &file_size_list](size_t k)
+            {
+                file_size_list[k] = fs::file_size(input_file_name_list[k]);
+            });
+        }
+
+        std::vector<file_work_item> work_item_list;
+        for (size_t k = 0; k < input_file_name_list.size(); k++)
+        {
+            uintmax_t file_size = file_size_list[k];
+            if (file_size <= range_size)
+            {
+                work_item_list.push_back(file_work_item{ &input_file_name_list[k], k, 0, 0 });
+            }
+            else
+            {
+                for (uintmax_t offset = 0; offset < file_size; offset += range_size)
+                {
+                    work_item_list.push_back(file_work_item{ &input_file_name_list[k], k, offset, range_size });
+                }
+            }
+        }
+        return work_item_list;
+    }
+
+    // Calls process(worker_index, i) for each work item on num_threads
+    // threads and commit(i) in the order of the items, so the results of
+    // each file are reported in the order of the input files.
+    template <typename F, typename C>
+    void parallel_for_file_work(const std::vector<file_work_item> &work_item_list, int num_threads, F process, C commit)
+    {
+        parallel_for_ordered(work_item_list.size(), num_threads, FILE_WORK_WINDOW_PER_THREAD * std::max(1, num_threads), process, commit);
+    }
+
+    // Reads the bytes of the work item. callback(nullptr, 0) is called at
+    // the end of the file.
+    inline void file_work_source(const file_work_item &item, data_source_callback callback)
+    {
+        if (item.size == 0)
+        {
+            file_source_default(*item.file_name, callback);
+        }
+        else
+        {
+            file_range_source_default(*item.file_name, item.offset, item.size, callback);
+        }
+    }
+
+    // Reads the lines which start in the work item. callback(nullptr, 0) is
+    // called at the end of the lines.
+    template <typename CharT>
+    void file_work_line_range_source(const file_work_item &item, data_source_callback callback)
+    {
+        if (item.size == 0)
+        {
+            file_source_default(*item.file_name, callback);
+        }
+        else
+        {
+            file_line_range_source_default<CharT>(*item.file_name, item.offset, item.size, callback);
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "lineindex.h"
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    static int index_usage()
+    {
+        std::wcout << "Usage: bigtext index [OPTION]... INPUTFILE..." << std::endl;
+        std::wcout << "Build the line index of the file in INPUTFILE.btidx." << std::endl;
+        std::wcout << std::endl;
+        std::wcout << " -f         rebuild the index even if it is up to date" << std::endl;
+        std::wcout << " -h         show this help message" << std::endl;
+        std::wcout << " -t N       use N threads" << std::endl;
+        std::wcout << " INPUTFILE  input file, directory, pattern or @LISTFILE" << std::endl;
+        return 0;
+    }
+
+    int index_command(int argc, wchar_t *argv[])
+    {
+        int optind = 1;
+        bool force_build = false;
+        uintmax_t num_threads = get_default_num_threads();
+        std::vector<fs::path> input_file_name_list;
+
+        if (argc <= 1)
+        {
+            return index_usage();
+        }
+
+        while (optind < argc)
+        {
+            const wchar_t *p = argv[optind++];
+            if (*p == '-')
+            {
+                ++p;
+                bool next_is_number = false;
+                while (*p != '\0')
+                {
+                    switch (*p)
+                    {
+                    case 'f':
+                        force_build = true;
+                        break;
+                    case 'h':
+                        return index_usage();
+                    case 't':
+                        next_is_number = true;
+                        break;
+                    default:
+                        std::wcerr << "Unknown option `" << *p << "'." << std::endl;
+                        return 1;
+                    }
+                    ++p;
+
+                    if (next_is_number)
+                    {
+                        if (*p == '\0')
+                        {
+                            if (optind >= argc)
+                            {
+                                std::wcerr << "Number of threads is expected." << std::endl;
+                                return 1;
+                            }
+                            p = argv[optind++];
+                        }
+
+                        if (!try_parse_number(p, num_threads) || num_threads > INT_MAX)
+                        {
+                            std::wcerr << "Invalid number of threads." << std::endl;
+                            return 1;
+                        }
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                // Input files start.
+                optind--;
+                break;
+            }
+        }
+
+        while (optind < argc)
+        {
+            const wchar_t *p = argv[optind++];
+            input_file_name_list.push_back(p);
+        }
+
+        if (input_file_name_list.size() == 0)
+        {
+            std::wcerr << "No input files." << std::endl;
+            return 1;
+        }
+
+        if (!expand_input_files(input_file_name_list, static_cast<int>(num_threads)))
+        {
+            return 1;
+        }
+
+        for (auto &file_name : input_file_name_list)
+        {
+            boost::timer::cpu_timer timer;
+            line_index index;
+            if (force_build || !index.open(file_name) || !index.verify(static_cast<int>(num_threads)))
+            {
+                index.close();
+                if (!file_build_line_index(file_name, static_cast<int>(num_threads)))
+                {
+                    return 1;
+                }
+                if (!index.open(file_name))
+                {
+                    std::wcerr << "`" << file_name.wstring() << "' changed while indexing." << std::endl;
+                    return 1;
+                }
+                std::wcerr << timer.format() << std::endl;
+            }
+            std::wcout << file_name.native() << "\tLineCount\t" << index.line_count() << std::endl;
+            std::wcout << file_name.native() << "\tIndexSize\t" << index.memory_size() << std::endl;
+        }
+
+        return 0;
+    }
+}
\ No newline at end of file
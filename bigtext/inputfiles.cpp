@@ -0,0 +1,294 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "lineindex.h"
+#include "parallel.h"
+
+#ifdef _WIN32
+#include <cwctype>
+#endif
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    template <typename CharT>
+    static bool has_wildcard(const std::basic_string<CharT> &s)
+    {
+        return s.find('*') != std::basic_string<CharT>::npos || s.find('?') != std::basic_string<CharT>::npos;
+    }
+
+    // File names are case insensitive on Windows, where the patterns are
+    // given to the command as they are by the shell.
+    template <typename CharT>
+    static bool equal_file_name_char(CharT x, CharT y)
+    {
+#ifdef _WIN32
+        return x == y || std::towlower(x) == std::towlower(y);
+#else
+        return x == y;
+#endif
+    }
+
+    // Matches s with the pattern, where * matches any characters and ?
+    // matches a character. The last * is retried with one more character
+    // on a mismatch, so no backtracking to the earlier ones is needed.
+    template <typename CharT>
+    static bool match_wildcard(const CharT *pattern, const CharT *s)
+    {
+        const CharT *star_pattern = nullptr;
+        const CharT *star_s = nullptr;
+        while (*s != '\0')
+        {
+            if (*pattern == '?' || (*pattern != '*' && equal_file_name_char(*pattern, *s)))
+            {
+                pattern++;
+                s++;
+            }
+            else if (*pattern == '*')
+            {
+                star_pattern = ++pattern;
+                star_s = s;
+            }
+            else if (star_pattern != nullptr)
+            {
+                pattern = star_pattern;
+                s = ++star_s;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        while (*pattern == '*') pattern++;
+        return *pattern == '\0';
+    }
+
+    // Hidden files and index files are not inputs in a directory. Names
+    // which start with a dot are matched only by a pattern which starts
+    // with a dot like the shell, and files with the hidden attribute on
+    // Windows are never matched.
+    static bool is_input_file_name(const fs::path &file_name, const fs::path &pattern)
+    {
+        fs::path name = file_name.filename();
+        if (line_index::is_index_file_name(name))
+        {
+            return false;
+        }
+#ifdef _WIN32
+        DWORD attributes = GetFileAttributesW(file_name.c_str());
+        if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_HIDDEN) != 0)
+        {
+            return false;
+        }
+#endif
+        return name.native()[0] != '.' || (!pattern.empty() && pattern.native()[0] == '.');
+    }
+
+    // Adds the paths which match the pattern with wildcards in any of its
+    // components. The paths in each directory are sorted by name.
+    static void expand_wildcard(const fs::path &pattern, std::vector<fs::path> &file_name_list)
+    {
+        std::vector<fs::path> base_list{ pattern.root_path() };
+        bool has_matched = false;
+        for (auto &component : pattern.relative_path())
+        {
+            std::vector<fs::path> next_list;
+            for (auto &base : base_list)
+            {
+                if (!has_wildcard(component.native()))
+                {
+                    // Only the paths which exist are the matches.
+                    boost::system::error_code ec;
+                    if (!has_matched || fs::exists(base / component, ec))
+                    {
+                        next_list.push_back(base / component);
+                    }
+                    continue;
+                }
+                std::vector<fs::path> match_list;
+                boost::system::error_code ec;
+                fs::directory_iterator it(base.empty() ? fs::path(".") : base, ec);
+                for (; !ec && it != fs::directory_iterator(); it.increment(ec))
+                {
+                    fs::path name = it->path().filename();
+                    if (is_input_file_name(it->path(), component) && match_wildcard(component.c_str(), name.c_str()))
+                    {
+                        match_list.push_back(base / name);
+                    }
+                }
+                std::sort(match_list.begin(), match_list.end());
+                next_list.insert(next_list.end(), match_list.begin(), match_list.end());
+            }
+            has_matched = has_matched || has_wildcard(component.native());
+            base_list.swap(next_list);
+        }
+        file_name_list.insert(file_name_list.end(), base_list.begin(), base_list.end());
+    }
+
+    // Adds the entries in the directory and its subdirectories which are not
+    // directories, sorted by path. Links to directories are not followed.
+    // Returns false after printing the directory which can't be read.
+    static bool expand_directory(const fs::path &dir_name, std::vector<fs::path> &file_name_list)
+    {
+        std::vector<fs::path> entry_list;
+        std::vector<fs::path> dir_list{ dir_name };
+        while (!dir_list.empty())
+        {
+            fs::path current_dir_name = dir_list.back();
+            dir_list.pop_back();
+            boost::system::error_code ec;
+            fs::directory_iterator it(current_dir_name, ec);
+            for (; !ec && it != fs::directory_iterator(); it.increment(ec))
+            {
+                if (!is_input_file_name(it->path(), fs::path()))
+                {
+                    continue;
+                }
+                boost::system::error_code status_ec;
+                if (it->symlink_status(status_ec).type() == fs::directory_file)
+                {
+                    dir_list.push_back(it->path());
+                }
+                else
+                {
+                    entry_list.push_back(it->path());
+                }
+            }
+            if (ec)
+            {
+                std::wcerr << "`" << current_dir_name.wstring() << "' can't be read." << std::endl;
+                return false;
+            }
+        }
+        std::sort(entry_list.begin(), entry_list.end());
+        file_name_list.insert(file_name_list.end(), entry_list.begin(), entry_list.end());
+        return true;
+    }
+
+    // Adds the files or directories listed in the file, one for each line.
+    static bool read_file_list(const fs::path &list_file_name, std::vector<fs::path> &file_name_list)
+    {
+        fs::ifstream in(list_file_name);
+        if (!in.is_open())
+        {
+            std::wcerr << "`" << list_file_name.wstring() << "' doesn't exist." << std::endl;
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            if (!line.empty())
+            {
+                file_name_list.emplace_back(line);
+            }
+        }
+        return true;
+    }
+
+    // Replaces the input specs with the input files. A spec is a file, a
+    // directory for all the files in it, a pattern with * and ? for the
+    // matching files, or @LISTFILE for the files and directories listed in
+    // LISTFILE. The files are checked on num_threads threads. Returns false
+    // after printing the error.
+    bool expand_input_files(std::vector<fs::path> &input_file_name_list, int num_threads)
+    {
+        std::vector<fs::path> spec_list;
+        for (auto &spec : input_file_name_list)
+        {
+            auto &s = spec.native();
+            if (s.size() > 1 && s[0] == '@')
+            {
+                if (!read_file_list(s.substr(1), spec_list))
+                {
+                    return false;
+                }
+            }
+            else if (has_wildcard(s))
+            {
+                size_t n = spec_list.size();
+                expand_wildcard(spec, spec_list);
+                if (spec_list.size() == n)
+                {
+                    std::wcerr << "No files match `" << spec.wstring() << "'." << std::endl;
+                    return false;
+                }
+            }
+            else
+            {
+                spec_list.push_back(spec);
+            }
+        }
+
+        // Most of the specs are files, so they are checked at once on the
+        // threads, and only the directories are read.
+        std::vector<fs::file_type> type_list(spec_list.size());
+        parallel_for(spec_list.size(), num_threads, [&spec_list, &type_list](size_t i)
+        {
+            boost::system::error_code ec;
+            type_list[i] = fs::status(spec_list[i], ec).type();
+        });
+
+        // The entries of the directories are not checked yet.
+        std::vector<fs::path> file_name_list;
+        std::vector<char> is_checked_list;
+        for (size_t i = 0; i < spec_list.size(); i++)
+        {
+            if (type_list[i] == fs::regular_file)
+            {
+                file_name_list.push_back(spec_list[i]);
+                is_checked_list.push_back(true);
+            }
+            else if (type_list[i] == fs::directory_file)
+            {
+                size_t n = file_name_list.size();
+                if (!expand_directory(spec_list[i], file_name_list))
+                {
+                    return false;
+                }
+                if (file_name_list.size() == n)
+                {
+                    std::wcerr << "`" << spec_list[i].wstring() << "' has no files." << std::endl;
+                    return false;
+                }
+                is_checked_list.resize(file_name_list.size(), false);
+            }
+            else
+            {
+                std::wcerr << "`" << spec_list[i].wstring() << "' doesn't exist." << std::endl;
+                return false;
+            }
+        }
+
+        // Links to directories and special files in the directories are
+        // skipped.
+        std::vector<char> is_file_list(file_name_list.size(), true);
+        parallel_for(file_name_list.size(), num_threads, [&file_name_list, &is_checked_list, &is_file_list](size_t i)
+        {
+            if (!is_checked_list[i])
+            {
+                boost::system::error_code ec;
+                is_file_list[i] = fs::is_regular_file(file_name_list[i], ec);
+            }
+        });
+        size_t num_files = 0;
+        for (size_t i = 0; i < file_name_list.size(); i++)
+        {
+            if (is_file_list[i])
+            {
+                file_name_list[num_files++].swap(file_name_list[i]);
+            }
+        }
+        file_name_list.resize(num_files);
+        input_file_name_list.swap(file_name_list);
+        return true;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,308 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "filesource.h"
+#include "filework.h"
+#include "lineindex.h"
+#include "outputsink.h"
+#include "packedvector.h"
+#include "parallel.h"
+#include "vocabtable.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    static const char LINE_INDEX_MAGIC[8] = { 'B', 'T', 'I', 'D', 'X', '0', '0', '2' };
+
+    static_assert(sizeof(line_index_header) == 64, "The header must be 64 bytes.");
+
+    // Hashes the hashes of the blocks, so that the blocks can be hashed
+    // on different threads.
+    class line_index_checksum
+    {
+    public:
+        line_index_checksum() : value_(0)
+        {
+        }
+
+        void update(const uint8_t *p, size_t size)
+        {
+            while (size > 0)
+            {
+                size_t n = std::min(size, LINE_INDEX_CHECKSUM_BLOCK_SIZE - buffer_.size());
+                buffer_.insert(buffer_.end(), p, p + n);
+                p += n;
+                size -= n;
+                if (buffer_.size() == LINE_INDEX_CHECKSUM_BLOCK_SIZE)
+                {
+                    add_block(hash_word(buffer_.data(), buffer_.size()));
+                    buffer_.clear();
+                }
+            }
+        }
+
+        void add_block(uint64_t block_hash)
+        {
+            value_ = mix_hash(value_ ^ block_hash);
+        }
+
+        uint64_t value()
+        {
+            if (!buffer_.empty())
+            {
+                add_block(hash_word(buffer_.data(), buffer_.size()));
+                buffer_.clear();
+            }
+            return value_;
+        }
+
+    private:
+        std::vector<uint8_t> buffer_;
+        uint64_t value_;
+    };
+
+    static uint64_t header_checksum(const line_index_header &header)
+    {
+        return hash_word(reinterpret_cast<const char *>(&header), offsetof(line_index_header, header_checksum));
+    }
+
+    // Last write time of the file in 100ns units on Windows and in
+    // nanoseconds elsewhere, or -1 if it is not known. Seconds are too
+    // coarse to tell a file rewritten right after it was indexed.
+    static int64_t file_write_time(const fs::path &file_name)
+    {
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExW(file_name.c_str(), GetFileExInfoStandard, &data))
+        {
+            return -1;
+        }
+        return static_cast<int64_t>((static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime);
+#else
+        struct stat st;
+        if (::stat(file_name.c_str(), &st) != 0)
+        {
+            return -1;
+        }
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+
+    line_index::line_index() : data_(nullptr)
+    {
+        std::memset(&header_, 0, sizeof header_);
+    }
+
+    fs::path line_index::index_file_name(const fs::path &file_name)
+    {
+        fs::path index_file_name = file_name;
+        index_file_name += ".btidx";
+        return index_file_name;
+    }
+
+    bool line_index::is_index_file_name(const fs::path &file_name)
+    {
+        fs::path extension = file_name.extension();
+        return extension == ".btidx" || (extension == ".tmp" && file_name.stem().extension() == ".btidx");
+    }
+
+    bool line_index::open(const fs::path &file_name)
+    {
+        close();
+        fs::path index_file_name = line_index::index_file_name(file_name);
+        boost::system::error_code ec;
+        uintmax_t index_size = fs::file_size(index_file_name, ec);
+        if (ec || index_size < sizeof header_)
+        {
+            return false;
+        }
+        try
+        {
+            file_.open(index_file_name);
+        }
+        catch (const std::ios_base::failure &)
+        {
+            return false;
+        }
+        if (!file_.is_open())
+        {
+            return false;
+        }
+
+        std::memcpy(&header_, file_.data(), sizeof header_);
+        bool valid = std::memcmp(header_.magic, LINE_INDEX_MAGIC, sizeof header_.magic) == 0
+            && header_.header_checksum == header_checksum(header_)
+            && header_.width >= 1 && header_.width <= 8
+            && header_.line_count <= header_.file_size
+            && index_size == sizeof header_ + (header_.line_count + 1) * header_.width
+            && header_.file_size == fs::file_size(file_name)
+            && header_.last_write_time != -1
+            && header_.last_write_time == file_write_time(file_name);
+        if (!valid)
+        {
+            file_.close();
+            std::memset(&header_, 0, sizeof header_);
+            return false;
+        }
+        data_ = reinterpret_cast<const uint8_t *>(file_.data()) + sizeof header_;
+        return true;
+    }
+
+    void line_index::close()
+    {
+        if (file_.is_open())
+        {
+            file_.close();
+        }
+        data_ = nullptr;
+    }
+
+    bool line_index::verify(int num_threads) const
+    {
+        size_t data_size = static_cast<size_t>((header_.line_count + 1) * header_.width);
+        size_t num_blocks = (data_size + LINE_INDEX_CHECKSUM_BLOCK_SIZE - 1) / LINE_INDEX_CHECKSUM_BLOCK_SIZE;
+        std::vector<uint64_t> block_hash_list(num_blocks);
+        parallel_for(num_blocks, num_threads, [this, data_size, &block_hash_list](size_t i)
+        {
+            size_t first = i * LINE_INDEX_CHECKSUM_BLOCK_SIZE;
+            size_t size = std::min(LINE_INDEX_CHECKSUM_BLOCK_SIZE, data_size - first);
+            block_hash_list[i] = hash_word(data_ + first, size);
+        });
+        line_index_checksum checksum;
+        for (uint64_t block_hash : block_hash_list)
+        {
+            checksum.add_block(block_hash);
+        }
+        return checksum.value() == header_.checksum
+            && offset(header_.line_count) == header_.file_size
+            && (header_.line_count == 0 || offset(0) == 0);
+    }
+
+    bool file_build_line_index(const fs::path &file_name, int num_threads)
+    {
+        // The file may change while it is being read. Then the index is
+        // for the old file and is not used.
+        uintmax_t file_size = fs::file_size(file_name);
+        int64_t last_write_time = file_write_time(file_name);
+        int width = packed_uint_vector::width_for(file_size);
+
+        fs::path index_file_name = line_index::index_file_name(file_name);
+        fs::path temp_file_name = index_file_name;
+        temp_file_name += ".tmp";
+
+        line_index_header header;
+        std::memset(&header, 0, sizeof header);
+        {
+            output_sink out;
+            if (!out.open(temp_file_name, false, true))
+            {
+                std::wcerr << __wcserror(temp_file_name.native().c_str());
+                return false;
+            }
+            out.write_bytes(&header, sizeof header);
+
+            // Each range has the lines starting after its new lines. The
+            // ranges are written in order as they are done.
+            line_index_checksum checksum;
+            uintmax_t line_count = 0;
+            bool success = true;
+            size_t num_ranges = static_cast<size_t>((file_size + LINE_INDEX_RANGE_SIZE - 1) / LINE_INDEX_RANGE_SIZE);
+            std::vector<packed_uint_vector> range_offset_list(num_ranges, packed_uint_vector(width));
+            std::vector<uintmax_t> range_end_list(num_ranges);
+            size_t window = FILE_WORK_WINDOW_PER_THREAD * std::max(1, num_threads);
+            parallel_for_ordered(num_ranges, num_threads, window, [&](int, size_t i)
+            {
+                auto &offset_list = range_offset_list[i];
+                uintmax_t first = i * LINE_INDEX_RANGE_SIZE;
+                uintmax_t size = std::min(LINE_INDEX_RANGE_SIZE, file_size - first);
+                uintmax_t offset = first;
+                if (first == 0)
+                {
+                    offset_list.push_back(0);
+                }
+                file_range_source_default(file_name, first, size, [&offset_list, &offset, file_size](const char *s, size_t len)
+                {
+                    if (s == nullptr)
+                    {
+                        return;
+                    }
+                    const char *last = s + len;
+                    for (const char *p = find_new_line(s, last); p != last; p = find_new_line(p + 1, last))
+                    {
+                        uintmax_t next = offset + (p + 1 - s);
+                        if (next < file_size)
+                        {
+                            offset_list.push_back(next);
+                        }
+                    }
+                    offset += len;
+                });
+                range_end_list[i] = offset;
+            }, [&](size_t i)
+            {
+                auto &offset_list = range_offset_list[i];
+                uintmax_t first = i * LINE_INDEX_RANGE_SIZE;
+                if (range_end_list[i] != first + std::min(LINE_INDEX_RANGE_SIZE, file_size - first))
+                {
+                    success = false;
+                }
+                if (success)
+                {
+                    size_t data_size = offset_list.size() * width;
+                    out.write_bytes(offset_list.data(), data_size);
+                    checksum.update(offset_list.data(), data_size);
+                    line_count += offset_list.size();
+                }
+                offset_list = packed_uint_vector(width);
+            });
+
+            uint64_t sentinel = file_size;
+            out.write_bytes(&sentinel, width);
+            checksum.update(reinterpret_cast<const uint8_t *>(&sentinel), width);
+            out.close();
+
+            // A range comes back short when the file is truncated.
+            boost::system::error_code ec;
+            if (!success || fs::file_size(file_name, ec) != file_size || file_write_time(file_name) != last_write_time)
+            {
+                std::wcerr << "`" << file_name.wstring() << "' changed while indexing." << std::endl;
+                fs::remove(temp_file_name);
+                return false;
+            }
+
+            std::memcpy(header.magic, LINE_INDEX_MAGIC, sizeof header.magic);
+            header.file_size = file_size;
+            header.last_write_time = last_write_time;
+            header.line_count = line_count;
+            header.width = width;
+            header.checksum = checksum.value();
+            header.header_checksum = header_checksum(header);
+        }
+
+        {
+            fs::fstream out(temp_file_name, std::ios::in | std::ios::out | std::ios::binary);
+            if (!out.is_open())
+            {
+                std::wcerr << __wcserror(temp_file_name.native().c_str());
+                return false;
+            }
+            out.write(reinterpret_cast<const char *>(&header), sizeof header);
+            if (!out)
+            {
+                std::wcerr << __wcserror(temp_file_name.native().c_str());
+                return false;
+            }
+        }
+        fs::rename(temp_file_name, index_file_name);
+        return true;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    // Bytes of each input range scanned by a thread when building an index.
+    static const uintmax_t LINE_INDEX_RANGE_SIZE = 16 * 1024 * 1024;
+    // Bytes of the index hashed at a time for the checksum.
+    static const size_t LINE_INDEX_CHECKSUM_BLOCK_SIZE = 1024 * 1024;
+
+    // Header of the index file. The start offsets of the lines and the
+    // size of the file follow the header, each in width bytes, little
+    // endian. The index is valid while the size and the last write time
+    // of the file match. The time is in the finest unit of the platform,
+    // which may still miss a file rewritten within its tick, so the users
+    // of the offsets check the new lines where they can.
+    struct line_index_header
+    {
+        char magic[8];
+        uint64_t file_size;
+        int64_t last_write_time;
+        uint64_t line_count;
+        uint32_t width;
+        uint32_t reserved;
+        uint64_t checksum;
+        uint64_t header_checksum;
+        uint64_t padding;
+    };
+
+    // Line offsets of a text file kept in a sidecar file, e.g. file.txt.btidx
+    // for file.txt, which is mapped to memory.
+    class line_index
+    {
+    public:
+        line_index();
+
+        line_index(const line_index &) = delete;
+        line_index &operator=(const line_index &) = delete;
+
+        static fs::path index_file_name(const fs::path &file_name);
+        // True if the file is an index file or a temporary one being built.
+        static bool is_index_file_name(const fs::path &file_name);
+
+        // Opens the index of the file. Returns false if there is no index
+        // or the index is not of the current file. Only the header is
+        // checked; call verify() to check the offsets.
+        bool open(const fs::path &file_name);
+        void close();
+        bool is_open() const
+        {
+            return data_ != nullptr;
+        }
+
+        // Checks the checksum of the offsets on num_threads threads.
+        bool verify(int num_threads = 1) const;
+
+        uintmax_t line_count() const
+        {
+            return header_.line_count;
+        }
+
+        uintmax_t file_size() const
+        {
+            return header_.file_size;
+        }
+
+        // Byte offset of the line n. offset(line_count()) is the file size.
+        uintmax_t offset(uintmax_t n) const
+        {
+            uint64_t value = 0;
+            std::memcpy(&value, data_ + n * header_.width, header_.width);
+            return value;
+        }
+
+        // Bytes of the line n with its new line.
+        uintmax_t line_size(uintmax_t n) const
+        {
+            return offset(n + 1) - offset(n);
+        }
+
+        uintmax_t memory_size() const
+        {
+            return file_.size();
+        }
+
+    private:
+        boost::iostreams::mapped_file_source file_;
+        line_index_header header_;
+        const uint8_t *data_;
+    };
+
+    // Builds the index of the file on num_threads threads and replaces
+    // the index file. Returns false after printing the error.
+    bool file_build_line_index(const fs::path &file_name, int num_threads);
+}
\ No newline at end of file
@@ -0,0 +1,176 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    // Each power of two is split into 2^LOG_HISTOGRAM_SUB_BITS buckets, so
+    // values in a bucket are within 1/16 of each other. Smaller values
+    // have their own buckets.
+    static const int LOG_HISTOGRAM_SUB_BITS = 4;
+    static const size_t LOG_HISTOGRAM_SUB_COUNT = static_cast<size_t>(1) << LOG_HISTOGRAM_SUB_BITS;
+    static const size_t LOG_HISTOGRAM_NUM_BUCKETS = LOG_HISTOGRAM_SUB_COUNT + (64 - LOG_HISTOGRAM_SUB_BITS) * LOG_HISTOGRAM_SUB_COUNT;
+
+    // Counts of values in log scale buckets of a fixed size. Histograms
+    // of parts of the data are merged by adding the counts.
+    class log_histogram
+    {
+    public:
+        log_histogram() : count_(0), min_(UINTMAX_MAX), max_(0)
+        {
+            std::fill(std::begin(count_list_), std::end(count_list_), 0);
+        }
+
+        void add(uintmax_t value)
+        {
+            count_list_[bucket_index(value)]++;
+            count_++;
+            if (min_ > value) min_ = value;
+            if (max_ < value) max_ = value;
+        }
+
+        void merge(const log_histogram &other)
+        {
+            for (size_t i = 0; i < LOG_HISTOGRAM_NUM_BUCKETS; i++)
+            {
+                count_list_[i] += other.count_list_[i];
+            }
+            count_ += other.count_;
+            if (min_ > other.min_) min_ = other.min_;
+            if (max_ < other.max_) max_ = other.max_;
+        }
+
+        uintmax_t count() const
+        {
+            return count_;
+        }
+
+        // Upper bound of the bucket of the q quantile, which is never more
+        // than the maximum value.
+        uintmax_t percentile(double q) const
+        {
+            if (count_ == 0)
+            {
+                return 0;
+            }
+            uintmax_t rank = static_cast<uintmax_t>(std::ceil(q * count_));
+            rank = std::min(std::max<uintmax_t>(rank, 1), count_);
+            uintmax_t total = 0;
+            for (size_t i = 0; i < LOG_HISTOGRAM_NUM_BUCKETS; i++)
+            {
+                total += count_list_[i];
+                if (total >= rank)
+                {
+                    return std::max(std::min(bucket_last(i), max_), min_);
+                }
+            }
+            return max_;
+        }
+
+        // Calls f(first, count) for each nonempty range [first, first * 2),
+        // or [0, 1) for first 0, in increasing order.
+        template <typename F>
+        void for_each_power_of_two(F f) const
+        {
+            uintmax_t range_first = 0;
+            uintmax_t range_count = 0;
+            for (size_t i = 0; i < LOG_HISTOGRAM_NUM_BUCKETS; i++)
+            {
+                if (count_list_[i] == 0)
+                {
+                    continue;
+                }
+                uintmax_t first = bucket_first(i);
+                uintmax_t power = first == 0 ? 0 : static_cast<uintmax_t>(1) << floor_log2(first);
+                if (power != range_first && range_count > 0)
+                {
+                    f(range_first, range_count);
+                    range_count = 0;
+                }
+                range_first = power;
+                range_count += count_list_[i];
+            }
+            if (range_count > 0)
+            {
+                f(range_first, range_count);
+            }
+        }
+
+    private:
+        static int floor_log2(uintmax_t value)
+        {
+            int e = 0;
+            while ((value >> (e + 1)) != 0) e++;
+            return e;
+        }
+
+        static size_t bucket_index(uintmax_t value)
+        {
+            if (value < LOG_HISTOGRAM_SUB_COUNT)
+            {
+                return static_cast<size_t>(value);
+            }
+            int shift = floor_log2(value) - LOG_HISTOGRAM_SUB_BITS;
+            return LOG_HISTOGRAM_SUB_COUNT * (shift + 1) + static_cast<size_t>((value >> shift) - LOG_HISTOGRAM_SUB_COUNT);
+        }
+
+        static uintmax_t bucket_first(size_t i)
+        {
+            if (i < LOG_HISTOGRAM_SUB_COUNT)
+            {
+                return i;
+            }
+            int shift = static_cast<int>(i / LOG_HISTOGRAM_SUB_COUNT) - 1;
+            return (LOG_HISTOGRAM_SUB_COUNT + i % LOG_HISTOGRAM_SUB_COUNT) << shift;
+        }
+
+        static uintmax_t bucket_last(size_t i)
+        {
+            if (i < LOG_HISTOGRAM_SUB_COUNT)
+            {
+                return i;
+            }
+            int shift = static_cast<int>(i / LOG_HISTOGRAM_SUB_COUNT) - 1;
+            return bucket_first(i) + ((static_cast<uintmax_t>(1) << shift) - 1);
+        }
+
+        uintmax_t count_list_[LOG_HISTOGRAM_NUM_BUCKETS];
+        uintmax_t count_;
+        uintmax_t min_;
+        uintmax_t max_;
+    };
+
+    // Histograms of the sizes of lines with their new lines and the
+    // numbers of white space delimited tokens in them.
+    struct line_size_sketch
+    {
+        log_histogram size_histogram;
+        log_histogram token_histogram;
+
+        template <typename CharT>
+        void add(const CharT *s, size_t len)
+        {
+            uintmax_t token_count = 0;
+            bool in_token = false;
+            for (size_t i = 0; i < len; i++)
+            {
+                bool is_token_char = !is_white_space(s[i]);
+                if (is_token_char && !in_token)
+                {
+                    token_count++;
+                }
+                in_token = is_token_char;
+            }
+            size_histogram.add(len);
+            token_histogram.add(token_count);
+        }
+
+        void merge(const line_size_sketch &other)
+        {
+            size_histogram.merge(other.size_histogram);
+            token_histogram.merge(other.token_histogram);
+        }
+    };
+}
\ No newline at end of file
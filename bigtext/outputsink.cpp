@@ -0,0 +1,220 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "outputsink.h"
+
+namespace bigtext
+{
+    static const char DIGIT_PAIRS[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    size_t format_number(char *buf, uintmax_t value)
+    {
+        // Two digits at a time from the end.
+        char tmp[20];
+        char *p = tmp + sizeof(tmp);
+        while (value >= 100)
+        {
+            size_t i = static_cast<size_t>(value % 100) * 2;
+            value /= 100;
+            *--p = DIGIT_PAIRS[i + 1];
+            *--p = DIGIT_PAIRS[i];
+        }
+        if (value >= 10)
+        {
+            size_t i = static_cast<size_t>(value) * 2;
+            *--p = DIGIT_PAIRS[i + 1];
+            *--p = DIGIT_PAIRS[i];
+        }
+        else
+        {
+            *--p = static_cast<char>('0' + value);
+        }
+        size_t len = tmp + sizeof(tmp) - p;
+        std::memcpy(buf, p, len);
+        return len;
+    }
+
+    output_sink::output_sink() : buffer_(nullptr), buffer_size_(0), used_(0), background_(false), stop_(false)
+    {
+    }
+
+    output_sink::~output_sink()
+    {
+        if (is_open())
+        {
+            try
+            {
+                close();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    bool output_sink::open(const fs::path &file_name, bool append, bool background, size_t buffer_size)
+    {
+        // The buffers are written as they are.
+        out_.rdbuf()->pubsetbuf(nullptr, 0);
+        out_.open(file_name, append ? std::ios::out | std::ios::binary | std::ios::app : std::ios::out | std::ios::binary);
+        if (!out_.is_open())
+        {
+            return false;
+        }
+        out_.exceptions(std::ios::failbit | std::ios::badbit);
+
+        background_ = background;
+        buffer_size_ = buffer_size;
+        size_t num_buffers = background ? OUTPUT_SINK_NUM_BUFFERS : 1;
+        for (size_t i = 0; i < num_buffers; i++)
+        {
+            buffer_list_.emplace_back(new char[buffer_size_]);
+            free_list_.push_back(buffer_list_.back().get());
+        }
+        buffer_ = free_list_.back();
+        free_list_.pop_back();
+        used_ = 0;
+
+        if (background_)
+        {
+            stop_ = false;
+            writer_ = std::thread(&output_sink::writer_main, this);
+        }
+        return true;
+    }
+
+    void output_sink::close()
+    {
+        std::exception_ptr error;
+        try
+        {
+            submit_buffer();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        if (background_)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            writer_.join();
+            background_ = false;
+            if (!error)
+            {
+                error = error_;
+            }
+        }
+
+        error_ = nullptr;
+        free_list_.clear();
+        buffer_list_.clear();
+        buffer_ = nullptr;
+        buffer_size_ = 0;
+        used_ = 0;
+        out_.exceptions(std::ios::goodbit);
+        out_.close();
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void output_sink::write_bytes_slow(const char *s, size_t size)
+    {
+        if (buffer_ == nullptr)
+        {
+            throw std::ios_base::failure("Output file is not open.");
+        }
+        while (size > 0)
+        {
+            size_t n = std::min(size, buffer_size_ - used_);
+            std::memcpy(buffer_ + used_, s, n);
+            used_ += n;
+            s += n;
+            size -= n;
+            if (used_ == buffer_size_)
+            {
+                submit_buffer();
+            }
+        }
+    }
+
+    void output_sink::submit_buffer()
+    {
+        if (used_ == 0)
+        {
+            return;
+        }
+
+        if (!background_)
+        {
+            out_.write(buffer_, used_);
+            used_ = 0;
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        full_list_.emplace_back(buffer_, used_);
+        buffer_ = nullptr;
+        used_ = 0;
+        cond_.notify_all();
+        cond_.wait(lock, [this] { return !free_list_.empty(); });
+        buffer_ = free_list_.back();
+        free_list_.pop_back();
+        if (error_)
+        {
+            std::rethrow_exception(error_);
+        }
+    }
+
+    void output_sink::writer_main()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            cond_.wait(lock, [this] { return !full_list_.empty() || stop_; });
+            if (full_list_.empty())
+            {
+                return;
+            }
+            auto buffer = full_list_.front();
+            full_list_.pop_front();
+            if (!error_)
+            {
+                lock.unlock();
+                try
+                {
+                    out_.write(buffer.first, buffer.second);
+                }
+                catch (...)
+                {
+                    lock.lock();
+                    error_ = std::current_exception();
+                    lock.unlock();
+                }
+                lock.lock();
+            }
+            free_list_.push_back(buffer.first);
+            cond_.notify_all();
+        }
+    }
+}
\ No newline at end of file
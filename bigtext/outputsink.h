@@ -0,0 +1,113 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    static const size_t OUTPUT_SINK_BUFFER_SIZE = 4 * 1024 * 1024;
+    static const size_t OUTPUT_SINK_NUM_BUFFERS = 3;
+
+    // Writes the digits of value to buf, which must have 20 characters,
+    // and returns the number of characters.
+    size_t format_number(char *buf, uintmax_t value);
+
+    // Output file which collects writes in large buffers and writes a
+    // buffer at a time. With a background writer, full buffers are written
+    // on another thread while the next buffer is being filled. Errors are
+    // thrown as std::ios_base::failure.
+    class output_sink
+    {
+    public:
+        output_sink();
+        ~output_sink();
+
+        output_sink(const output_sink &) = delete;
+        output_sink &operator=(const output_sink &) = delete;
+
+        bool open(const fs::path &file_name, bool append = false, bool background = false, size_t buffer_size = OUTPUT_SINK_BUFFER_SIZE);
+        bool is_open() const
+        {
+            return out_.is_open();
+        }
+
+        // Writes the remaining buffer and closes the file.
+        void close();
+
+        void write_bytes(const void *s, size_t size)
+        {
+            if (size <= buffer_size_ - used_)
+            {
+                std::memcpy(buffer_ + used_, s, size);
+                used_ += size;
+            }
+            else
+            {
+                write_bytes_slow(static_cast<const char *>(s), size);
+            }
+        }
+
+        template <typename CharT>
+        void write(const CharT *s, size_t len)
+        {
+            write_bytes(s, len * sizeof(CharT));
+        }
+
+        template <typename CharT>
+        void put(CharT ch)
+        {
+            write_bytes(&ch, sizeof(CharT));
+        }
+
+        // Ends a line of a text output like a text mode stream, with CR LF
+        // on Windows. The lines copied from the inputs are written as they
+        // are.
+        template <typename CharT>
+        void put_text_new_line()
+        {
+#ifdef _WIN32
+            put<CharT>('\r');
+#endif
+            put<CharT>('\n');
+        }
+
+        template <typename CharT>
+        void write_number(uintmax_t value)
+        {
+            char buf[20];
+            size_t len = format_number(buf, value);
+            if (sizeof(CharT) == sizeof(char))
+            {
+                write_bytes(buf, len);
+            }
+            else
+            {
+                CharT wbuf[20];
+                std::copy(buf, buf + len, wbuf);
+                write(wbuf, len);
+            }
+        }
+
+    private:
+        void write_bytes_slow(const char *s, size_t size);
+        void submit_buffer();
+        void writer_main();
+
+        fs::ofstream out_;
+        std::vector<std::unique_ptr<char[]>> buffer_list_;
+        char *buffer_;
+        size_t buffer_size_;
+        size_t used_;
+        bool background_;
+        std::thread writer_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::vector<char *> free_list_;
+        std::deque<std::pair<char *, size_t>> full_list_;
+        std::exception_ptr error_;
+        bool stop_;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,116 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    // Array of unsigned integers which keeps each value in the given
+    // number of bytes, e.g. 5 bytes for offsets into files up to 1TB.
+    // Values are little endian and only their own bytes are written, so
+    // threads can set different values at the same time.
+    class packed_uint_vector
+    {
+    public:
+        explicit packed_uint_vector(int width = 8) : size_(0)
+        {
+            set_width(width);
+        }
+
+        // Number of bytes to keep values up to max_value.
+        static int width_for(uintmax_t max_value)
+        {
+            int width = 1;
+            while (width < 8 && (max_value >> (width * 8)) != 0) width++;
+            return width;
+        }
+
+        int width() const
+        {
+            return width_;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        size_t memory_size() const
+        {
+            return data_.capacity();
+        }
+
+        // The values as width() bytes each.
+        const uint8_t *data() const
+        {
+            return data_.data();
+        }
+
+        // Drops the values keeping the memory.
+        void clear()
+        {
+            size_ = 0;
+            data_.clear();
+        }
+
+        void reserve(size_t n)
+        {
+            data_.reserve(n * width_);
+        }
+
+        // Drops the values and changes the width.
+        void assign(size_t n, int width)
+        {
+            set_width(width);
+            size_ = n;
+            data_.clear();
+            data_.shrink_to_fit();
+            data_.resize(n * width_, 0);
+        }
+
+        uint64_t get(size_t i) const
+        {
+            uint64_t value = 0;
+            std::memcpy(&value, &data_[i * width_], width_);
+            return value;
+        }
+
+        void set(size_t i, uint64_t value)
+        {
+            std::memcpy(&data_[i * width_], &value, width_);
+        }
+
+        void push_back(uint64_t value)
+        {
+            size_t required = (size_ + 1) * width_;
+            if (data_.size() < required)
+            {
+                if (data_.capacity() < required)
+                {
+                    data_.reserve(std::max(required, data_.capacity() * 2));
+                }
+                data_.resize(required, 0);
+            }
+            set(size_++, value);
+        }
+
+        void swap(size_t i, size_t j)
+        {
+            uint64_t x = get(i);
+            set(i, get(j));
+            set(j, x);
+        }
+
+    private:
+        void set_width(int width)
+        {
+            assert(width >= 1 && width <= 8);
+            width_ = width;
+        }
+
+        std::vector<uint8_t> data_;
+        size_t size_;
+        int width_;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,145 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    // Calls f(worker_index, i) for i in [0, n) on num_threads threads.
+    // worker_index is in [0, num_threads) and no two calls with the same
+    // worker_index run at the same time, so it can index per-thread state.
+    // Items are taken in increasing order. The first exception thrown by f
+    // is rethrown after all the threads finish.
+    template <typename F>
+    void parallel_for_workers(size_t n, int num_threads, F f)
+    {
+        if (num_threads <= 1 || n <= 1)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                f(0, i);
+            }
+            return;
+        }
+
+        std::atomic<size_t> next_index(0);
+        std::exception_ptr first_exception;
+        std::mutex exception_mutex;
+        auto worker = [&](int worker_index)
+        {
+            while (true)
+            {
+                size_t i = next_index++;
+                if (i >= n) break;
+                try
+                {
+                    f(worker_index, i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(exception_mutex);
+                    if (!first_exception) first_exception = std::current_exception();
+                    next_index = n;
+                }
+            }
+        };
+
+        std::vector<std::thread> thread_list;
+        int num_workers = static_cast<int>(std::min(static_cast<size_t>(num_threads), n));
+        for (int i = 1; i < num_workers; i++)
+        {
+            thread_list.emplace_back(worker, i);
+        }
+        worker(0);
+        for (auto &t : thread_list)
+        {
+            t.join();
+        }
+
+        if (first_exception)
+        {
+            std::rethrow_exception(first_exception);
+        }
+    }
+
+    // Calls f(i) for i in [0, n) on num_threads threads.
+    template <typename F>
+    void parallel_for(size_t n, int num_threads, F f)
+    {
+        parallel_for_workers(n, num_threads, [&f](int, size_t i) { f(i); });
+    }
+
+    // Calls process(worker_index, i) for i in [0, n) on num_threads threads
+    // as parallel_for_workers, and commit(i) in increasing order of i as
+    // soon as i and all the items before it are processed. commit is called
+    // on one thread at a time and without the lock, by the thread which
+    // finished the last one of them, so the other workers finish and start
+    // items while it commits. An item is not started until it is within
+    // window items of the next commit, which bounds the results waiting to
+    // be committed.
+    template <typename F, typename C>
+    void parallel_for_ordered(size_t n, int num_threads, size_t window, F process, C commit)
+    {
+        std::mutex commit_mutex;
+        std::condition_variable commit_cond;
+        size_t next_commit = 0;
+        bool committing = false;
+        bool failed = false;
+        std::vector<bool> done_list(n);
+        window = std::max<size_t>(window, 1);
+        parallel_for_workers(n, num_threads, [&](int worker_index, size_t i)
+        {
+            {
+                std::unique_lock<std::mutex> lock(commit_mutex);
+                commit_cond.wait(lock, [&next_commit, &failed, i, window] { return failed || i < next_commit + window; });
+                if (failed) return;
+            }
+            try
+            {
+                process(worker_index, i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(commit_mutex);
+                failed = true;
+                commit_cond.notify_all();
+                throw;
+            }
+
+            // The items done while another thread commits are left to it,
+            // as it looks for the next items after each run of commits.
+            std::unique_lock<std::mutex> lock(commit_mutex);
+            done_list[i] = true;
+            if (committing) return;
+            committing = true;
+            while (!failed)
+            {
+                size_t first_commit = next_commit;
+                size_t last_commit = first_commit;
+                while (last_commit < n && done_list[last_commit]) last_commit++;
+                if (last_commit == first_commit) break;
+                lock.unlock();
+                try
+                {
+                    for (size_t j = first_commit; j < last_commit; j++)
+                    {
+                        commit(j);
+                    }
+                }
+                catch (...)
+                {
+                    lock.lock();
+                    failed = true;
+                    committing = false;
+                    commit_cond.notify_all();
+                    throw;
+                }
+                lock.lock();
+                next_commit = last_commit;
+                commit_cond.notify_all();
+            }
+            committing = false;
+        });
+    }
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "parallel.h"
+#include "random.h"
+
+namespace bigtext
+{
+    uint64_t make_random_seed()
+    {
+        std::random_device device;
+        uint64_t state = (static_cast<uint64_t>(device()) << 32) ^ device();
+        state ^= static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        return splitmix64(state);
+    }
+
+    template <typename T>
+    static void fisher_yates_shuffle(T *list, size_t n, xoshiro256 &gen)
+    {
+        for (size_t i = n; i > 1; i--)
+        {
+            size_t j = static_cast<size_t>(bounded_random(gen, i));
+            std::swap(list[i - 1], list[j]);
+        }
+    }
+
+    // Shuffles in two steps. Each position is sent to a random block, and
+    // then each block is shuffled in cache. As the blocks are chosen
+    // uniformly and each block is shuffled uniformly, the result is a
+    // uniform permutation. The positions are split into chunks, which send
+    // their positions to the blocks in parallel. The generator of a chunk
+    // is replayed to write the positions after counting them.
+    void random_permutation(packed_uint_vector &list, uint64_t seed, int num_threads)
+    {
+        size_t n = list.size();
+        size_t num_blocks = std::min(PERMUTATION_MAX_BLOCKS, (n + PERMUTATION_BLOCK_SIZE - 1) / PERMUTATION_BLOCK_SIZE);
+        if (num_blocks <= 1)
+        {
+            std::vector<uint64_t> block(n);
+            for (size_t i = 0; i < n; i++)
+            {
+                block[i] = i;
+            }
+            xoshiro256 gen(seed);
+            fisher_yates_shuffle(block.data(), n, gen);
+            for (size_t i = 0; i < n; i++)
+            {
+                list.set(i, block[i]);
+            }
+            return;
+        }
+
+        size_t num_chunks = std::min(PERMUTATION_MAX_CHUNKS, (n + PERMUTATION_CHUNK_SIZE - 1) / PERMUTATION_CHUNK_SIZE);
+        auto chunk_begin = [n, num_chunks](size_t c) { return static_cast<size_t>(static_cast<uintmax_t>(n) * c / num_chunks); };
+
+        // Count the positions of each chunk in each block.
+        std::vector<size_t> offset_list(num_chunks * num_blocks, 0);
+        parallel_for(num_chunks, num_threads, [&](size_t c)
+        {
+            xoshiro256 gen(seed, c);
+            size_t *count_list = &offset_list[c * num_blocks];
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+            {
+                count_list[bounded_random(gen, num_blocks)]++;
+            }
+        });
+
+        // The blocks are laid out in order, and the chunks in order in each
+        // block.
+        std::vector<size_t> block_offset_list(num_blocks + 1);
+        size_t offset = 0;
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            block_offset_list[b] = offset;
+            for (size_t c = 0; c < num_chunks; c++)
+            {
+                size_t count = offset_list[c * num_blocks + b];
+                offset_list[c * num_blocks + b] = offset;
+                offset += count;
+            }
+        }
+        block_offset_list[num_blocks] = offset;
+        assert(offset == n);
+
+        // Replay the generators to write the positions. The chunks write
+        // to disjoint positions.
+        parallel_for(num_chunks, num_threads, [&](size_t c)
+        {
+            xoshiro256 gen(seed, c);
+            size_t *position_list = &offset_list[c * num_blocks];
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++)
+            {
+                list.set(position_list[bounded_random(gen, num_blocks)]++, i);
+            }
+        });
+
+        parallel_for(num_blocks, num_threads, [&](size_t b)
+        {
+            xoshiro256 gen(seed, num_chunks + b);
+            size_t first = block_offset_list[b];
+            size_t len = block_offset_list[b + 1] - first;
+            std::vector<uint64_t> block(len);
+            for (size_t i = 0; i < len; i++)
+            {
+                block[i] = list.get(first + i);
+            }
+            fisher_yates_shuffle(block.data(), len, gen);
+            for (size_t i = 0; i < len; i++)
+            {
+                list.set(first + i, block[i]);
+            }
+        });
+    }
+}
\ No newline at end of file
@@ -0,0 +1,169 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "packedvector.h"
+
+namespace bigtext
+{
+    inline uint64_t splitmix64(uint64_t &state)
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // xoshiro256** generator. Generators with the same seed and different
+    // streams are seeded independently, so that each chunk of work can
+    // have its own sequence regardless of the thread which runs it.
+    class xoshiro256
+    {
+    public:
+        typedef uint64_t result_type;
+
+        explicit xoshiro256(uint64_t seed, uint64_t stream = 0)
+        {
+            uint64_t state = seed;
+            state ^= splitmix64(state) ^ stream;
+            for (int i = 0; i < 4; i++)
+            {
+                s_[i] = splitmix64(state);
+            }
+        }
+
+        static constexpr result_type min()
+        {
+            return 0;
+        }
+
+        static constexpr result_type max()
+        {
+            return ~static_cast<result_type>(0);
+        }
+
+        result_type operator()()
+        {
+            uint64_t result = rotl(s_[1] * 5, 7) * 9;
+            uint64_t t = s_[1] << 17;
+            s_[2] ^= s_[0];
+            s_[3] ^= s_[1];
+            s_[1] ^= s_[2];
+            s_[0] ^= s_[3];
+            s_[2] ^= t;
+            s_[3] = rotl(s_[3], 45);
+            return result;
+        }
+
+    private:
+        static uint64_t rotl(uint64_t x, int k)
+        {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        uint64_t s_[4];
+    };
+
+    inline uint64_t multiply_high(uint64_t x, uint64_t y, uint64_t &low)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        uint64_t high;
+        low = _umul128(x, y, &high);
+        return high;
+#elif defined(__SIZEOF_INT128__)
+        unsigned __int128 z = static_cast<unsigned __int128>(x) * y;
+        low = static_cast<uint64_t>(z);
+        return static_cast<uint64_t>(z >> 64);
+#else
+        // Adds the four 32 by 32 bits products, as there is no 64 bits
+        // multiply with the high half on the other targets.
+        uint64_t x_low = x & 0xffffffff;
+        uint64_t x_high = x >> 32;
+        uint64_t y_low = y & 0xffffffff;
+        uint64_t y_high = y >> 32;
+        uint64_t low_low = x_low * y_low;
+        uint64_t high_low = x_high * y_low;
+        uint64_t low_high = x_low * y_high;
+        uint64_t high_high = x_high * y_high;
+        uint64_t middle = (low_low >> 32) + (high_low & 0xffffffff) + low_high;
+        low = (middle << 32) | (low_low & 0xffffffff);
+        return high_high + (high_low >> 32) + (middle >> 32);
+#endif
+    }
+
+    // Uniform integer in [0, n) with Lemire's multiply and reject method,
+    // which only divides when the first draw falls in the biased range.
+    template <typename Gen>
+    uint64_t bounded_random(Gen &gen, uint64_t n)
+    {
+        uint64_t low;
+        uint64_t high = multiply_high(gen(), n, low);
+        if (low < n)
+        {
+            uint64_t threshold = (0 - n) % n;
+            while (low < threshold)
+            {
+                high = multiply_high(gen(), n, low);
+            }
+        }
+        return high;
+    }
+
+    // Philox4x32-10 counter based generator. The output only depends on the
+    // key and the counter, so the random number of an item can be computed
+    // from its position on any thread in any order.
+    inline void philox4x32(uint32_t counter[4], uint64_t key)
+    {
+        uint32_t k0 = static_cast<uint32_t>(key);
+        uint32_t k1 = static_cast<uint32_t>(key >> 32);
+        for (int round = 0; round < 10; round++)
+        {
+            uint64_t p0 = static_cast<uint64_t>(0xd2511f53U) * counter[0];
+            uint64_t p1 = static_cast<uint64_t>(0xcd9e8d57U) * counter[2];
+            uint32_t c1 = counter[1];
+            uint32_t c3 = counter[3];
+            counter[0] = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+            counter[1] = static_cast<uint32_t>(p1);
+            counter[2] = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+            counter[3] = static_cast<uint32_t>(p0);
+            k0 += 0x9e3779b9U;
+            k1 += 0xbb67ae85U;
+        }
+    }
+
+    // 64 random bits for the position (stream, index) with the seed.
+    inline uint64_t random_at(uint64_t seed, uint64_t stream, uint64_t index)
+    {
+        uint32_t counter[4] = {
+            static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32),
+            static_cast<uint32_t>(stream), static_cast<uint32_t>(stream >> 32) };
+        philox4x32(counter, seed);
+        return (static_cast<uint64_t>(counter[1]) << 32) | counter[0];
+    }
+
+    // Uniform double in [0, 1) from 64 random bits.
+    inline double random_unit(uint64_t x)
+    {
+        return static_cast<double>(x >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Seed which differs in every run, for when no seed is given.
+    uint64_t make_random_seed();
+
+    // Number of positions each chunk assigns to blocks in parallel.
+    static const size_t PERMUTATION_CHUNK_SIZE = 1024 * 1024;
+    static const size_t PERMUTATION_MAX_CHUNKS = 256;
+    // Number of positions shuffled in cache by a block.
+    static const size_t PERMUTATION_BLOCK_SIZE = 64 * 1024;
+    static const size_t PERMUTATION_MAX_BLOCKS = 4096;
+
+    // Fills list with a uniform random permutation of [0, list.size()). The
+    // result only depends on the seed and the size, not on num_threads.
+    void random_permutation(packed_uint_vector &list, uint64_t seed, int num_threads);
+}
\ No newline at end of file
@@ -17,19 +17,31 @@ namespace bigtext
     {
         std::wcout << "Usage: bigtext sample [OPTION]... INPUTFILE... [[-o|-n LINES|-r RATE] OUTPUTFILE]..." << std::endl;
         std::wcout << std::endl;
-        std::wcout << " -c N       shuffle output files with N interleaving" << std::endl;
+        std::wcout << " -c N       shuffle output files with N temporary buckets" << std::endl;
         std::wcout << " -f         force overwrite output files" << std::endl;
         std::wcout << " -h         show this help message" << std::endl;
         std::wcout << " -q         quick mode" << std::endl;
         std::wcout << " -s         shuffle output files" << std::endl;
-        std::wcout << " INPUTFILE  input file" << std::endl;
+        std::wcout << " --seed N   seed of the random numbers to reproduce the output" << std::endl;
+        std::wcout << " -t N       use N threads to sample or shuffle" << std::endl;
+        std::wcout << " INPUTFILE  input file, directory, pattern or @LISTFILE" << std::endl;
         std::wcout << " -o         sample all lines" << std::endl;
-        std::wcout << " -n LINES   sample around n lines" << std::endl;
+        std::wcout << " -n LINES   sample n lines, or around n lines with other outputs" << std::endl;
         std::wcout << " -r RATE    sampling rate. Probability (0.0,1.0] or percent (0,100]%" << std::endl;
         std::wcout << " OUTPUTFILE output file" << std::endl;
         return 0;
     }
 
+    static bool try_parse_seed(const std::wstring &s, uintmax_t &seed)
+    {
+        if (s == L"0")
+        {
+            seed = 0;
+            return true;
+        }
+        return try_parse_number(s, seed);
+    }
+
     static bool has_number_of_lines(const std::vector<sample_output_spec> &output_spec_list)
     {
         return std::any_of(output_spec_list.cbegin(), output_spec_list.cend(), [](auto &spec) { return spec.number_of_lines != 0; });
@@ -85,20 +97,9 @@ namespace bigtext
 
         for (auto &file_name : input_file_name_list)
         {
-            guess_line_info info = file_stat_lines<CharT>(file_name);
-            double est_line_count;
-            if (info.is_accurate)
-            {
-                std::wcout << file_name.native() << "\tEstLineCount\t" << info.line_count << std::endl;
-                est_line_count = static_cast<double>(info.line_count);
-            }
-            else
-            {
-                uintmax_t size = fs::file_size(file_name);
-                est_line_count = info.avg_line_size == 0 ? 1.0 : (size / (sizeof(CharT) * info.avg_line_size));
-                std::wcout << file_name.native() << "\tEstLineCount\t" << est_line_count << std::endl;
-            }
-            total_number_of_lines += est_line_count;
+            guess_line_info info = file_guess_lines<CharT>(file_name);
+            std::wcout << file_name.native() << "\tEstLineCount\t" << info.est_line_count << std::endl;
+            total_number_of_lines += info.est_line_count;
         }
 
         return total_number_of_lines;
@@ -118,7 +119,10 @@ namespace bigtext
     int sample_command(int argc, wchar_t *argv[])
     {
         int optind = 1;
-        uintmax_t interleaving_size = 0;
+        uintmax_t num_buckets = 0;
+        uintmax_t num_threads = get_default_num_threads();
+        uintmax_t seed = 0;
+        bool has_seed = false;
         bool force_overwrite = false;
         bool shuffle_output = false;
         bool has_output_all = false;
@@ -148,13 +152,35 @@ namespace bigtext
                 return 1;
             }
 
-            bool next_is_number = false;
+            if (*p == '-')
+            {
+                if (std::wcscmp(p, L"-seed") != 0)
+                {
+                    std::wcerr << "Unknown option `" << (p - 1) << "'." << std::endl;
+                    return 1;
+                }
+                if (optind >= argc)
+                {
+                    std::wcerr << "Seed is expected." << std::endl;
+                    return 1;
+                }
+                if (!try_parse_seed(argv[optind++], seed))
+                {
+                    std::wcerr << "Invalid seed." << std::endl;
+                    return 1;
+                }
+                has_seed = true;
+                continue;
+            }
+
+            wchar_t number_option = '\0';
             while (*p != '\0')
             {
                 switch (*p)
                 {
                 case 'c':
-                    next_is_number = true;
+                case 't':
+                    number_option = *p;
                     break;
                 case 'f':
                     force_overwrite = true;
@@ -178,31 +204,49 @@ namespace bigtext
                 }
                 ++p;
 
-                if (next_is_number)
+                if (number_option != '\0')
                 {
                     if (*p == '\0')
                     {
                         if (optind >= argc)
                         {
-                            std::wcerr << "Interlaving size is expected." << std::endl;
+                            if (number_option == 't')
+                            {
+                                std::wcerr << "Number of threads is expected." << std::endl;
+                            }
+                            else
+                            {
+                                std::wcerr << "Number of buckets is expected." << std::endl;
+                            }
                             return 1;
                         }
                         p = argv[optind++];
                     }
 
-                    if (!try_parse_number(p, interleaving_size))
+                    if (number_option == 't')
                     {
-                        std::wcerr << "Invalid interleaving size." << std::endl;
-                        return 1;
+                        if (!try_parse_number(p, num_threads) || num_threads > INT_MAX)
+                        {
+                            std::wcerr << "Invalid number of threads." << std::endl;
+                            return 1;
+                        }
+                    }
+                    else
+                    {
+                        if (!try_parse_number(p, num_buckets))
+                        {
+                            std::wcerr << "Invalid number of buckets." << std::endl;
+                            return 1;
+                        }
                     }
                     break;
                 }
             }
         }
 
-        if (interleaving_size > 0 && !shuffle_output)
+        if (num_buckets > 0 && !shuffle_output)
         {
-            std::wcerr << "Interleaving size is allowed only in the shuffle mode." << std::endl;
+            std::wcerr << "Number of buckets is allowed only in the shuffle mode." << std::endl;
             return 1;
         }
 
@@ -346,8 +390,9 @@ namespace bigtext
             return 1;
         }
 
-        // Verify all the input files exist
-        if (!check_input_files(input_file_name_list))
+        // Expand the directories, patterns and lists, and verify all the
+        // input files exist.
+        if (!expand_input_files(input_file_name_list, static_cast<int>(num_threads)))
         {
             return 1;
         }
@@ -363,7 +408,11 @@ namespace bigtext
             }
         }
 
-        std::srand(static_cast<int>(std::time(nullptr)));
+        if (!has_seed)
+        {
+            seed = make_random_seed();
+        }
+        std::wcout << "\tSeed\t" << seed << std::endl;
 
         boost::timer::cpu_timer timer;
 
@@ -375,12 +424,6 @@ namespace bigtext
                 return 1;
             }
 
-            if (input_file_name_list.size() != 1)
-            {
-                std::wcerr << "Only one input file is allowed." << std::endl;
-                return 1;
-            }
-
             if (has_sample_all(output_spec_list))
             {
                 std::wcerr << "Sampling all lines doesn't make sense with quick mode." << std::endl;
@@ -394,30 +437,35 @@ namespace bigtext
                 convert_to_number_of_lines(output_spec_list, total_number_of_lines);
             }
 
-            file_quick_sample_file_lines<char>(input_file_name_list[0], output_spec_list);
+            file_quick_sample_file_lines<char>(input_file_name_list, output_spec_list, seed);
         }
         else if (shuffle_output)
         {
             uintmax_t physical_memory_size;
             uintmax_t total_file_size;
 
-            if (interleaving_size != 1)
+            if (num_buckets != 1)
             {
                 physical_memory_size = get_physical_memory_size();
-                if (interleaving_size == 0)
+                total_file_size = get_total_file_size(input_file_name_list);
+                if (num_buckets == 0 && total_file_size < physical_memory_size * 8 / 10)
                 {
-                    total_file_size = get_total_file_size(input_file_name_list);
-                    if (total_file_size < physical_memory_size * 8 / 10)
+                    // If the files and the line index fit in memory, then
+                    // we shuffle in memory.
+                    double total_number_of_lines = guess_total_number_of_lines<char>(input_file_name_list);
+                    uintmax_t bytes_per_line = shuffle_index_bytes_per_line(total_file_size, static_cast<uintmax_t>(total_number_of_lines));
+                    uintmax_t index_size = static_cast<uintmax_t>(total_number_of_lines * bytes_per_line);
+                    std::wcout << "\tEstIndexSize\t" << index_size << std::endl;
+                    if (total_file_size + index_size < physical_memory_size * 8 / 10)
                     {
-                        // if the files are small, then we don't try interleaving.
-                        interleaving_size = 1;
+                        num_buckets = 1;
                     }
                 }
             }
 
-            if (interleaving_size == 1)
+            if (num_buckets == 1)
             {
-                file_shuffle_lines<char>(input_file_name_list, output_spec_list);
+                file_shuffle_lines<char>(input_file_name_list, output_spec_list, seed, static_cast<int>(num_threads));
             }
             else
             {
@@ -426,20 +474,25 @@ namespace bigtext
                 heap_vector<char> heap;
                 heap.alloc(SHUFFLE_MIN_BUFFER_SIZE, physical_memory_size);
                 size_t buffer_size = heap.size();
-                if (interleaving_size == 0)
+                if (num_buckets == 0)
                 {
                     // We use 60% of phsical memory at most.
-                    uintmax_t interleaving_size_memory = 1 + (total_file_size * 5) / (physical_memory_size * 3);
+                    uintmax_t num_buckets_memory = 1 + (total_file_size * 5) / (physical_memory_size * 3);
                     // We use 80% of buffer size at most
-                    uintmax_t interleaving_size_buffer_size = 1 + (total_file_size * 5) / (buffer_size * 4);
-                    interleaving_size = std::max(interleaving_size_memory, interleaving_size_buffer_size);
+                    uintmax_t num_buckets_buffer_size = 1 + (total_file_size * 5) / (buffer_size * 4);
+                    num_buckets = std::max(num_buckets_memory, num_buckets_buffer_size);
                 }
-                assert(interleaving_size >= 1);
-                std::wcout << "\tInterleavingSize\t" << interleaving_size << std::endl;
+                assert(num_buckets >= 1);
+                std::wcout << "\tBucketCount\t" << num_buckets << std::endl;
                 std::wcout << "\tBufferSize\t" << heap.size() << std::endl;
-                file_shuffle_lines<char>(input_file_name_list, output_spec_list, interleaving_size, heap);
+                file_shuffle_lines<char>(input_file_name_list, output_spec_list, num_buckets, heap, seed, static_cast<int>(num_threads));
             }
         }
+        else if (std::all_of(output_spec_list.cbegin(), output_spec_list.cend(), [](auto &spec) { return spec.number_of_lines != 0; }))
+        {
+            // Only the numbers of lines are specified.
+            file_reservoir_sample<char>(input_file_name_list, output_spec_list, seed);
+        }
         else
         {
             if (has_number_of_lines(output_spec_list))
@@ -452,11 +505,11 @@ namespace bigtext
             if (output_spec_list.size() == 1 && output_spec_list[0].number_of_lines == 0)
             {
                 assert(output_spec_list[0].number_of_lines == 0);
-                file_line_sample<char>(input_file_name_list, output_spec_list[0].rate, output_spec_list[0].file_name);
+                file_line_sample<char>(input_file_name_list, output_spec_list[0].rate, output_spec_list[0].file_name, seed, static_cast<int>(num_threads));
             }
             else
             {
-                file_line_sample<char>(input_file_name_list, output_spec_list);
+                file_line_sample<char>(input_file_name_list, output_spec_list, seed, static_cast<int>(num_threads));
             }
         }
 
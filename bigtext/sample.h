@@ -5,13 +5,30 @@
 #pragma once
 #include <exception>
 
+#include "filework.h"
+#include "lineindex.h"
+#include "outputsink.h"
+#include "parallel.h"
+#include "random.h"
+
 namespace bigtext
 {
     namespace fs = boost::filesystem;
     namespace ios = boost::iostreams;
     namespace rnd = boost::random;
 
+    // Size of the ranges which are sampled in parallel.
+    static const uintmax_t SAMPLE_RANGE_SIZE = 16 * 1024 * 1024;
+    // Total rate below which lines are skipped by counting new lines.
+    static const double SAMPLE_SKIP_MAX_RATE = 0.01;
     static const size_t SHUFFLE_MIN_BUFFER_SIZE = 1LL * 1024 * 1024;
+    static const size_t SHUFFLE_BUCKET_BUFFER_SIZE = 1024 * 1024;
+    static const size_t SHUFFLE_GATHER_BLOCK_LINES = 16 * 1024;
+    // Lines closer than this are prefetched by a single request.
+    static const size_t SHUFFLE_PREFETCH_MAX_GAP = 256 * 1024;
+    // Bytes read at each offset in the quick mode. The lines which don't
+    // fit in them are read again with a stream.
+    static const size_t QUICK_SAMPLE_READ_SIZE = 64 * 1024;
 
     struct sample_output_spec
     {
@@ -25,106 +42,396 @@ namespace bigtext
         sample_output_spec(const fs::path &file_name, uintmax_t number_of_lines) : file_name(file_name), rate(0.0), number_of_lines(number_of_lines) {}
     };
 
-    template <typename CharT>
-    void file_line_sample(const std::vector<fs::path> &input_file_name_list, double rate, fs::path &output_file_name)
+    // Samples lines from the data from source at a low total rate. The
+    // number of lines between sampled lines is drawn from the geometric
+    // distribution, and those lines are passed by counting new lines, so
+    // they need no random numbers. A sampled line goes to output k with
+    // probability rate_list[k] / total_rate. emit(k, s, len) is called with
+    // the parts of the sampled lines.
+    template <typename CharT, typename Source, typename Emit>
+    void skip_sample_from(Source source, xoshiro256 &gen, const std::vector<double> &rate_list, double total_rate, Emit emit)
     {
-        rnd::mt19937_64 gen(std::time(nullptr));
-        rnd::bernoulli_distribution<> dist(rate);
+        double log_not_rate = std::log1p(-total_rate);
+        auto draw_skip = [&gen, log_not_rate]() -> uintmax_t
+        {
+            double g = std::floor(std::log(1.0 - random_unit(gen())) / log_not_rate);
+            return g < 1.8e19 ? static_cast<uintmax_t>(g) : UINTMAX_MAX;
+        };
+        auto draw_output = [&gen, &rate_list, total_rate]() -> int
+        {
+            double t = random_unit(gen()) * total_rate;
+            size_t k = 0;
+            while (k + 1 < rate_list.size() && t >= rate_list[k])
+            {
+                t -= rate_list[k++];
+            }
+            return static_cast<int>(k);
+        };
 
-        fs::ofstream out;
-        out.open(output_file_name, std::ios::out | std::ios::binary);
-        if (!out.is_open())
+        uintmax_t skip = draw_skip();
+        int output = -1; // Output of the sampled line which continues.
+        source([&](const char *_s, size_t _len)
         {
-            std::wcerr << __wcserror(output_file_name.native().c_str());
-            return;
-        }
-        out.exceptions(std::ifstream::failbit);
+            const CharT *s = reinterpret_cast<const CharT *>(_s);
+            if (s == nullptr)
+            {
+                return;
+            }
+            const CharT *last = s + _len / sizeof(CharT);
+            while (s != last)
+            {
+                if (output >= 0)
+                {
+                    const CharT *p = find_new_line(s, last);
+                    if (p == last)
+                    {
+                        emit(output, s, last - s);
+                        return;
+                    }
+                    emit(output, s, p + 1 - s);
+                    s = p + 1;
+                    output = -1;
+                    skip = draw_skip();
+                }
+                else if (skip > 0)
+                {
+                    s = skip_new_lines(s, last, skip);
+                }
+                else
+                {
+                    output = draw_output();
+                }
+            }
+        });
+    }
 
-        for (auto &file_name : input_file_name_list)
+    // Sends each line to the first output whose rate is above the random
+    // number of the line, less the rates of the previous outputs. The ranges
+    // of all the files are sampled on the threads into buffers of each range
+    // for each output, and the buffers are written in the order of the
+    // ranges as soon as the ranges before them are done. As the random number
+    // of a line only depends on the seed and the position of the line, the
+    // outputs are the same on any number of threads. Low total rates skip
+    // lines with skip_sample_from, whose generator is seeded by the range.
+    template <typename CharT>
+    void sample_lines_by_rate(const std::vector<fs::path> &input_file_name_list, const std::vector<double> &rate_list, std::vector<std::unique_ptr<output_sink>> &out_list, uint64_t seed, int num_threads)
+    {
+        size_t num_outputs = rate_list.size();
+        double total_rate = std::accumulate(rate_list.begin(), rate_list.end(), 0.0);
+        bool skip_mode = total_rate <= SAMPLE_SKIP_MAX_RATE;
+        // Large files are split into line-aligned ranges when sampling in
+        // parallel, or when the ranges must be the same as in parallel.
+        auto work_item_list = split_file_work(input_file_name_list, SAMPLE_RANGE_SIZE, num_threads > 1 || skip_mode, num_threads);
+
+        std::vector<std::vector<std::vector<CharT>>> range_buffer_list(work_item_list.size());
+        parallel_for_file_work(work_item_list, num_threads, [&](int, size_t i)
         {
-            file_line_source_default<CharT>(file_name, [&dist, &gen, &out](const CharT *s, size_t len)
+            auto &item = work_item_list[i];
+            auto &file_name = input_file_name_list[item.file_index];
+            auto &buffer_list = range_buffer_list[i];
+            buffer_list.resize(num_outputs);
+            auto emit = [&](size_t k, const CharT *s, size_t len)
             {
-                if (dist(gen))
+                if (num_threads <= 1)
                 {
-                    out.write(reinterpret_cast<const char *>(s), sizeof(CharT) * len);
+                    // The ranges are in order on a single thread.
+                    out_list[k]->write(s, len);
                 }
-            });
+                else
+                {
+                    buffer_list[k].insert(buffer_list[k].end(), s, s + len);
+                }
+            };
+
+            if (skip_mode)
+            {
+                xoshiro256 gen(random_at(seed, item.file_index, item.offset));
+                skip_sample_from<CharT>([&item](data_source_callback f)
+                {
+                    file_work_line_range_source<CharT>(item, f);
+                }, gen, rate_list, total_rate, emit);
+            }
+            else
+            {
+                uintmax_t first_line_offset = 0;
+                uintmax_t offset = 0;
+                auto callback = [&](const CharT *s, size_t len)
+                {
+                    double t = random_unit(random_at(seed, item.file_index, first_line_offset / sizeof(CharT) + offset));
+                    offset += len;
+                    for (size_t k = 0; k < num_outputs; k++)
+                    {
+                        if (t < rate_list[k])
+                        {
+                            emit(k, s, len);
+                            break;
+                        }
+                        t -= rate_list[k];
+                    }
+                };
+                if (item.size == 0)
+                {
+                    file_line_source_default<CharT>(file_name, callback);
+                }
+                else
+                {
+                    file_line_source_default<CharT>(file_name, item.offset, item.size, callback, &first_line_offset);
+                }
+            }
+
+        }, [&range_buffer_list, &out_list, num_outputs](size_t i)
+        {
+            auto &buffer_list = range_buffer_list[i];
+            for (size_t k = 0; k < num_outputs; k++)
+            {
+                out_list[k]->write(buffer_list[k].data(), buffer_list[k].size());
+            }
+            std::vector<std::vector<CharT>>().swap(buffer_list);
+        });
+
+        for (auto &out : out_list)
+        {
+            out->close();
         }
     }
 
     template <typename CharT>
-    void file_line_sample(const std::vector<fs::path> &input_path_list, const std::vector<sample_output_spec> &output_spec_list)
+    void file_line_sample(const std::vector<fs::path> &input_file_name_list, double rate, fs::path &output_file_name, uint64_t seed, int num_threads)
     {
-        struct output_progress
+        std::vector<std::unique_ptr<output_sink>> out_list;
+        out_list.emplace_back(new output_sink());
+        if (!out_list.back()->open(output_file_name, false, true))
         {
-            double random_threshold;
-            uintmax_t line_count;
-            fs::ofstream out;
-        };
-
-        size_t num_outputs;
-        output_progress *output_progress_list;
-        rnd::mt19937_64 gen(std::time(nullptr));
-        rnd::uniform_real_distribution<> dist(0, 1);
+            std::wcerr << __wcserror(output_file_name.native().c_str());
+            return;
+        }
 
-        num_outputs = output_spec_list.size();
-        output_progress_list = new output_progress[num_outputs];
+        sample_lines_by_rate<CharT>(input_file_name_list, std::vector<double>{ rate }, out_list, seed, num_threads);
+    }
 
-        for (size_t i = 0; i < num_outputs; i++)
+    template <typename CharT>
+    void file_line_sample(const std::vector<fs::path> &input_path_list, const std::vector<sample_output_spec> &output_spec_list, uint64_t seed, int num_threads)
+    {
+        std::vector<double> rate_list;
+        std::vector<std::unique_ptr<output_sink>> out_list;
+        for (auto &spec : output_spec_list)
         {
-            auto &spec = output_spec_list[i];
             if (spec.number_of_lines != 0)
             {
                 throw std::logic_error("Taget lines is not allowed.");
             }
             else if (spec.rate >= 0)
             {
-                output_progress_list[i].random_threshold = spec.rate;
+                rate_list.push_back(spec.rate);
             }
             else
             {
                 throw std::logic_error("None of taget lines or rate is specified.");
             }
-            auto &out = output_progress_list[i].out;
-            out.open(spec.file_name, std::ios::out | std::ios::binary);
-            if (!out.is_open())
+            out_list.emplace_back(new output_sink());
+            if (!out_list.back()->open(spec.file_name, false, true))
             {
                 std::wcerr << __wcserror(spec.file_name.native().c_str());
                 return;
             }
-            out.exceptions(std::ifstream::failbit);
         }
 
-        for (auto &file_name : input_path_list)
+        sample_lines_by_rate<CharT>(input_path_list, rate_list, out_list, seed, num_threads);
+    }
+
+    // Samples exactly n lines, or all the lines if there are fewer, in a
+    // single pass with reservoir sampling (Algorithm L). After the
+    // reservoir is full, the number of lines to the next line which enters
+    // the reservoir is drawn at random, and the lines before it are passed
+    // by counting new lines. Each sampled line keeps its line number.
+    template <typename CharT>
+    class reservoir_sampler
+    {
+    public:
+        struct sampled_line
+        {
+            uintmax_t line_number;
+            std::basic_string<CharT> line;
+        };
+
+        reservoir_sampler(size_t n, xoshiro256 &gen) : n_(n), gen_(gen), w_(1.0), skip_(0), line_number_(0), copying_(false), mid_line_(false)
+        {
+            if (n_ == 0)
+            {
+                skip_ = UINTMAX_MAX;
+            }
+        }
+
+        // Takes the data of a file. s is nullptr at the end of the file.
+        void add(const CharT *s, size_t len)
         {
-            file_line_source_default<CharT>(file_name, [&dist, &gen, output_progress_list, num_outputs](const CharT *s, size_t len)
+            if (s == nullptr)
+            {
+                if (mid_line_)
+                {
+                    // The last line of the file without a new line is kept
+                    // as it is, as in the rate mode.
+                    if (copying_)
+                    {
+                        finish_line();
+                    }
+                    else
+                    {
+                        skip_--;
+                        line_number_++;
+                    }
+                    mid_line_ = false;
+                }
+                return;
+            }
+
+            const CharT *last = s + len;
+            while (s != last)
             {
-                double t = dist(gen);
-                for (int i = 0; i < num_outputs; i++)
+                if (copying_)
                 {
-                    auto &prog = output_progress_list[i];
-                    if (t < prog.random_threshold)
+                    const CharT *p = find_new_line(s, last);
+                    if (p == last)
                     {
-                        prog.out.write(reinterpret_cast<const char *>(s), sizeof(CharT) * len);
-                        ++prog.line_count;
-                        break;
+                        line_.append(s, last);
+                        mid_line_ = true;
+                        return;
                     }
-                    t -= prog.random_threshold;
+                    line_.append(s, p + 1);
+                    s = p + 1;
+                    mid_line_ = false;
+                    finish_line();
                 }
+                else if (skip_ > 0)
+                {
+                    uintmax_t skip = skip_;
+                    s = skip_new_lines(s, last, skip_);
+                    line_number_ += skip - skip_;
+                    mid_line_ = skip_ > 0 && !is_new_line(last[-1]);
+                }
+                else
+                {
+                    copying_ = true;
+                    line_.clear();
+                }
+            }
+        }
+
+        std::vector<sampled_line> &sample_list()
+        {
+            return sample_list_;
+        }
+
+    private:
+        double random_log()
+        {
+            return std::log(1.0 - random_unit(gen_()));
+        }
+
+        uintmax_t draw_skip()
+        {
+            double g = std::floor(random_log() / std::log1p(-w_));
+            return g < 1.8e19 ? static_cast<uintmax_t>(g) : UINTMAX_MAX;
+        }
+
+        void finish_line()
+        {
+            copying_ = false;
+            if (sample_list_.size() < n_)
+            {
+                sample_list_.push_back(sampled_line{ line_number_++, line_ });
+                if (sample_list_.size() == n_)
+                {
+                    w_ = std::exp(random_log() / n_);
+                    skip_ = draw_skip();
+                }
+                return;
+            }
+            auto &sample = sample_list_[static_cast<size_t>(bounded_random(gen_, n_))];
+            sample.line_number = line_number_++;
+            sample.line.swap(line_);
+            w_ *= std::exp(random_log() / n_);
+            skip_ = draw_skip();
+        }
+
+        size_t n_;
+        xoshiro256 &gen_;
+        double w_;
+        uintmax_t skip_;
+        uintmax_t line_number_;
+        bool copying_;
+        bool mid_line_;
+        std::basic_string<CharT> line_;
+        std::vector<sampled_line> sample_list_;
+    };
+
+    // Samples the number of lines of each output without overlap in a
+    // single pass. The sampled lines are dealt to the outputs at random, and
+    // each output is written in the order of the input.
+    template <typename CharT>
+    void file_reservoir_sample(const std::vector<fs::path> &input_file_name_list, const std::vector<sample_output_spec> &output_spec_list, uint64_t seed)
+    {
+        using SampledLineT = typename reservoir_sampler<CharT>::sampled_line;
+        uintmax_t total_number_of_lines = 0;
+        for (auto &spec : output_spec_list)
+        {
+            total_number_of_lines += spec.number_of_lines;
+        }
+
+        xoshiro256 gen(seed);
+        reservoir_sampler<CharT> sampler(static_cast<size_t>(total_number_of_lines), gen);
+        for (auto &file_name : input_file_name_list)
+        {
+            file_source_default(file_name, [&sampler](const char *s, size_t len)
+            {
+                sampler.add(reinterpret_cast<const CharT *>(s), len / sizeof(CharT));
             });
         }
 
-        delete[] output_progress_list;
+        auto &sample_list = sampler.sample_list();
+        for (size_t i = sample_list.size(); i > 1; i--)
+        {
+            std::swap(sample_list[i - 1], sample_list[static_cast<size_t>(bounded_random(gen, i))]);
+        }
+
+        auto first = sample_list.begin();
+        for (auto &spec : output_spec_list)
+        {
+            auto last = first + static_cast<size_t>(std::min<uintmax_t>(spec.number_of_lines, sample_list.end() - first));
+            std::sort(first, last, [](const SampledLineT &x, const SampledLineT &y) { return x.line_number < y.line_number; });
+            std::wcerr << spec.file_name.native() << "\tLineCount\t" << (last - first) << std::endl;
+
+            output_sink out;
+            if (!out.open(spec.file_name, false, true))
+            {
+                std::wcerr << __wcserror(spec.file_name.native().c_str());
+                return;
+            }
+            for (auto it = first; it != last; ++it)
+            {
+                out.write(it->line.data(), it->line.size());
+            }
+            out.close();
+            first = last;
+        }
+    }
+
+    // Bytes of the one-pass shuffle index for each line; the line start
+    // offset and the permutation entry.
+    inline uintmax_t shuffle_index_bytes_per_line(uintmax_t total_size, uintmax_t num_lines)
+    {
+        return packed_uint_vector::width_for(total_size) + packed_uint_vector::width_for(num_lines);
     }
 
     template<typename CharT>
-    void file_shuffle_lines(const std::vector<fs::path> &input_file_name_list, const std::vector<sample_output_spec> &output_spec_list)
+    void file_shuffle_lines(const std::vector<fs::path> &input_file_name_list, const std::vector<sample_output_spec> &output_spec_list, uint64_t seed, int num_threads)
     {
-        std::vector<size_t> line_index_list;
-        std::vector<const CharT *> line_position_list;
-
+        // The files are concatenated in a single offset space. A line ends
+        // where the next line starts, so one offset per line is enough.
         std::vector<ios::mapped_file_source> file_list;
-        size_t line_index = 0;
+        std::vector<fs::path> file_name_list;
+        std::vector<uintmax_t> file_offset_list;
+        uintmax_t total_len = 0;
         for (auto &input_file_name : input_file_name_list)
         {
             if (fs::file_size(input_file_name) == 0)
@@ -133,7 +440,6 @@ namespace bigtext
                 std::wcout << "`" << input_file_name.native() << "' is empty." << std::endl;
                 continue;
             }
-            size_t prev_line_index = line_index;
             file_list.emplace_back();
             auto &file = file_list.back();
             file.open(input_file_name);
@@ -142,53 +448,121 @@ namespace bigtext
                 std::wcerr << __wcserror(input_file_name.native().c_str());
                 return;
             }
+            file_name_list.push_back(input_file_name);
+            file_offset_list.push_back(total_len);
+            total_len += file.size() / sizeof(CharT);
+        }
 
-            const CharT *s = reinterpret_cast<const CharT *>(file.data());
-            size_t len = file.size() / sizeof(CharT);
+        packed_uint_vector line_offset_list(packed_uint_vector::width_for(total_len));
+        for (size_t k = 0; k < file_list.size(); k++)
+        {
+            auto &input_file_name = file_name_list[k];
+            const CharT *s = reinterpret_cast<const CharT *>(file_list[k].data());
+            size_t len = file_list[k].size() / sizeof(CharT);
+            uintmax_t base = file_offset_list[k];
             std::wcout << input_file_name.native() << "\tCharCount\t" << len << std::endl;
 
-            line_position_list.push_back(s);
-            for (size_t i = 0; i < len; i++)
+            size_t prev_num_lines = line_offset_list.size();
+            line_index index;
+            bool use_index = index.open(input_file_name) && index.verify(num_threads) && index.file_size() == len * sizeof(CharT);
+            if (use_index)
             {
-                if (s[i] == '\n')
+                // The index has the offsets in bytes. The file may have been
+                // rewritten within the tick of its write time, so each line
+                // must start after a new line.
+                uintmax_t prev_offset = 0;
+                for (uintmax_t n = 1; n < index.line_count() && use_index; n++)
                 {
-                    line_index_list.push_back(line_index++);
-                    line_position_list.push_back(&s[i + 1]);
+                    uintmax_t offset = index.offset(n) / sizeof(CharT);
+                    use_index = offset > prev_offset && offset < len && s[offset - 1] == '\n';
+                    prev_offset = offset;
                 }
             }
-            if (len > 0 && s[len - 1] != '\n')
+            if (use_index)
             {
-                line_index_list.push_back(line_index++);
-                line_position_list.push_back(&s[len]);
+                line_offset_list.reserve(prev_num_lines + static_cast<size_t>(index.line_count()) + 1);
+                for (uintmax_t n = 0; n < index.line_count(); n++)
+                {
+                    line_offset_list.push_back(base + index.offset(n) / sizeof(CharT));
+                }
+            }
+            else
+            {
+                line_offset_list.push_back(base);
+                const CharT *last = s + len;
+                for (const CharT *p = find_new_line(s, last); p != last; p = find_new_line(p + 1, last))
+                {
+                    if (p + 1 != last)
+                    {
+                        line_offset_list.push_back(base + (p + 1 - s));
+                    }
+                }
             }
 
-            std::wcout << input_file_name.native() << "\tLineCount\t" << (line_index - prev_line_index) << std::endl;
-            line_index++;
+            std::wcout << input_file_name.native() << "\tLineCount\t" << (line_offset_list.size() - prev_num_lines) << std::endl;
         }
+        size_t num_lines = line_offset_list.size();
+        line_offset_list.push_back(total_len);
 
         // Shuffle lines
 
-        size_t num_lines = line_index_list.size();
-        std::cout << "\tLineCount\t" << num_lines << std::endl;
-        if (line_index - file_list.size() != num_lines)
+        packed_uint_vector line_index_list;
+        line_index_list.assign(num_lines, packed_uint_vector::width_for(num_lines));
+        std::wcout << "\tLineCount\t" << num_lines << std::endl;
+        std::wcout << "\tIndexSize\t" << (line_offset_list.memory_size() + line_index_list.memory_size()) << std::endl;
+
+        random_permutation(line_index_list, seed, num_threads);
+
+        // Write lines
+
+        auto find_line = [&](size_t n, size_t &len)
         {
-            std::wcerr << "something wrong" << std::endl;
-            return;
-        }
+            uintmax_t first = line_offset_list.get(n);
+            uintmax_t last = line_offset_list.get(n + 1);
+            size_t k = std::upper_bound(file_offset_list.begin(), file_offset_list.end(), first) - file_offset_list.begin() - 1;
+            len = static_cast<size_t>(last - first);
+            return reinterpret_cast<const CharT *>(file_list[k].data()) + (first - file_offset_list[k]);
+        };
 
-        rnd::mt19937_64 gen(std::time(nullptr));
-        rnd::random_number_generator<rnd::mt19937_64, size_t> dist(gen);
-        if (num_lines > 0)
+        // Prefetches the lines in sorted order merging near ones, so that
+        // there are a few requests when the lines are dense.
+        auto prefetch_lines = [&](size_t first_index, size_t last_index)
         {
-            for (size_t i = 0; i < num_lines - 1; i++)
+            std::vector<std::pair<uintmax_t, uintmax_t>> range_list;
+            range_list.reserve(last_index - first_index);
+            for (size_t i = first_index; i < last_index; i++)
             {
-                size_t j = i + dist(num_lines - i);
-                std::swap(line_index_list[i], line_index_list[j]);
+                size_t n = static_cast<size_t>(line_index_list.get(i));
+                range_list.emplace_back(line_offset_list.get(n), line_offset_list.get(n + 1));
             }
-        }
+            std::sort(range_list.begin(), range_list.end());
+            size_t i = 0;
+            while (i < range_list.size())
+            {
+                uintmax_t first = range_list[i].first;
+                uintmax_t last = range_list[i].second;
+                size_t k = std::upper_bound(file_offset_list.begin(), file_offset_list.end(), first) - file_offset_list.begin() - 1;
+                uintmax_t file_last = k + 1 < file_offset_list.size() ? file_offset_list[k + 1] : total_len;
+                for (i++; i < range_list.size() && range_list[i].first < file_last && range_list[i].first <= last + SHUFFLE_PREFETCH_MAX_GAP / sizeof(CharT); i++)
+                {
+                    last = std::max(last, range_list[i].second);
+                }
+                const CharT *s = reinterpret_cast<const CharT *>(file_list[k].data()) + (first - file_offset_list[k]);
+                prefetch_memory(s, static_cast<size_t>(last - first) * sizeof(CharT));
+            }
+        };
 
-        // Write lines
+        bool prefetch = !std::all_of(file_list.begin(), file_list.end(), [](const ios::mapped_file_source &file)
+        {
+            return is_memory_resident(file.data(), file.size());
+        });
 
+        // The lines are gathered in blocks on the threads. A block first
+        // prefetches the lines of the block a batch ahead, so that their
+        // pages are read while this batch is copied. The blocks are
+        // written in order.
+        std::vector<std::vector<CharT>> block_list(std::max(1, num_threads));
+        size_t batch_size = block_list.size();
         size_t cur_index = 0;
         for (auto &output_spec : output_spec_list)
         {
@@ -205,105 +579,80 @@ namespace bigtext
             {
                 line_count = static_cast<uintmax_t>(num_lines * output_spec.rate + 0.5);
             }
+            line_count = std::min<uintmax_t>(line_count, num_lines - cur_index);
 
-            std::wcerr << output_spec.file_name.native() << "\tLineCount\t" << std::min(line_count, num_lines - cur_index) << std::endl;
+            std::wcerr << output_spec.file_name.native() << "\tLineCount\t" << line_count << std::endl;
 
-            fs::basic_ofstream<CharT> out;
-            out.open(output_spec.file_name, std::ios::out | std::ios::binary);
-            if (!out.is_open())
+            output_sink out;
+            if (!out.open(output_spec.file_name, false, true))
             {
                 std::wcerr << __wcserror(output_spec.file_name.native().c_str());
                 return;
             }
-            out.exceptions(std::ifstream::failbit);
 
-            for (uintmax_t i = 0; i < line_count; i++)
+            size_t first_index = cur_index;
+            size_t last_index = cur_index + static_cast<size_t>(line_count);
+            size_t num_blocks = (last_index - first_index + SHUFFLE_GATHER_BLOCK_LINES - 1) / SHUFFLE_GATHER_BLOCK_LINES;
+            auto block_range = [first_index, last_index](size_t b)
             {
-                if (cur_index >= num_lines)
-                {
-                    break;
-                }
-
-                size_t n = line_index_list[cur_index++];
-                const CharT *first = line_position_list[n];
-                const CharT *last = line_position_list[n + 1];
-                out.write(first, last - first);
-            }
-        }
-    }
-
-    template<typename CharT>
-    void file_shuffle_lines(const std::vector<fs::path> &input_file_name_list, const std::vector<sample_output_spec> &output_spec_list, uintmax_t interleaving_size, heap_vector<CharT> &heap)
-    {
-        rnd::mt19937_64 gen(std::time(nullptr));
-        const CharT *buffer_last = heap.ptr() + heap.size();
-        for (uintmax_t slice_start = interleaving_size; slice_start > 0; --slice_start)
-        {
-            std::wcout << "\tCurrentSlice\t" << slice_start << std::endl;
-            std::vector<const CharT *> line_position_list;
-            uintmax_t current_slice = slice_start;
-            uintmax_t line_count = 0;
-            CharT *p = heap.ptr();
-            line_position_list.push_back(p);
-
-            for (auto &input_file_name : input_file_name_list)
+                size_t first = first_index + b * SHUFFLE_GATHER_BLOCK_LINES;
+                return std::make_pair(first, std::min(last_index, first + SHUFFLE_GATHER_BLOCK_LINES));
+            };
+            for (size_t batch = 0; batch < num_blocks; batch += batch_size)
             {
-                std::wcout << input_file_name.native() << "\tReading" << std::endl;
-                file_line_source_default<CharT>(input_file_name, [&p, buffer_last, &current_slice, &line_position_list, &line_count, interleaving_size](const CharT *s, size_t len)
+                size_t n = std::min(batch_size, num_blocks - batch);
+                parallel_for(n, num_threads, [&](size_t j)
                 {
-                    if (s != nullptr)
+                    if (prefetch && batch + j + batch_size < num_blocks)
+                    {
+                        auto range = block_range(batch + j + batch_size);
+                        prefetch_lines(range.first, range.second);
+                    }
+
+                    auto &block = block_list[j];
+                    block.clear();
+                    auto range = block_range(batch + j);
+                    for (size_t i = range.first; i < range.second; i++)
                     {
-                        if (--current_slice == 0)
+                        size_t len;
+                        const CharT *s = find_line(static_cast<size_t>(line_index_list.get(i)), len);
+                        block.insert(block.end(), s, s + len);
+                        if (s[len - 1] != '\n')
                         {
-                            std::memcpy(p, s, len * sizeof(CharT));
-                            p += len;
-                            line_position_list.push_back(p);
-                            current_slice = interleaving_size;
+                            // The last line of the file without a new line.
+                            block.push_back('\n');
                         }
-                        line_count++;
                     }
                 });
-            }
-
-            // Shuffle lines
-
-            std::vector<size_t> line_index_list;
-            uintmax_t num_lines = line_position_list.size() - 1;
-            std::wcout << "Shuffling " << num_lines << " lines" << std::endl;
-            std::wcout.flush();
-            line_index_list.resize(num_lines);
-            for (size_t i = 0; i != num_lines; i++)
-            {
-                line_index_list[i] = i;
-            }
-
-            rnd::random_number_generator<rnd::mt19937_64, size_t> dist(gen);
-            if (num_lines > 0)
-            {
-                for (size_t i = 0; i < num_lines - 1; i++)
+                for (size_t j = 0; j < n; j++)
                 {
-                    size_t j = i + dist(num_lines - i);
-                    std::swap(line_index_list[i], line_index_list[j]);
+                    out.write(block_list[j].data(), block_list[j].size());
                 }
             }
+            cur_index = last_index;
+            out.close();
+        }
+    }
 
-            // Write lines
+    // Writes shuffled lines to the outputs in order. Each output takes its
+    // number of lines and the rest are dropped.
+    template <typename CharT>
+    class shuffle_output_writer
+    {
+    public:
+        shuffle_output_writer() : output_index_(0), remaining_(0)
+        {
+        }
 
-            size_t cur_index = 0;
+        bool open(const std::vector<sample_output_spec> &output_spec_list, uintmax_t num_lines)
+        {
+            uintmax_t cur_index = 0;
             for (auto &output_spec : output_spec_list)
             {
                 uintmax_t line_count;
                 if (output_spec.number_of_lines > 0)
                 {
-                    if (slice_start == interleaving_size)
-                    {
-                        uintmax_t u = output_spec.number_of_lines / interleaving_size;
-                        line_count = output_spec.number_of_lines - u * (interleaving_size - 1);
-                    }
-                    else
-                    {
-                        line_count = output_spec.number_of_lines / interleaving_size;
-                    }
+                    line_count = output_spec.number_of_lines;
                 }
                 else if (output_spec.rate >= 1.0)
                 {
@@ -313,79 +662,430 @@ namespace bigtext
                 {
                     line_count = static_cast<uintmax_t>(num_lines * output_spec.rate + 0.5);
                 }
+                line_count = std::min(line_count, num_lines - cur_index);
+                cur_index += line_count;
 
-                std::wcerr << output_spec.file_name.native() << "\tLineCount\t" << std::min(line_count, num_lines - cur_index) << std::endl;
+                std::wcerr << output_spec.file_name.native() << "\tLineCount\t" << line_count << std::endl;
 
-                fs::basic_ofstream<CharT> out;
-                int mode = std::ios::out | std::ios::binary;
-                if (slice_start != interleaving_size)
-                {
-                    mode |= std::ios::app;
-                }
-                out.open(output_spec.file_name, mode);
-                if (!out.is_open())
+                sink_list_.emplace_back(new output_sink());
+                if (!sink_list_.back()->open(output_spec.file_name, false, true))
                 {
                     std::wcerr << __wcserror(output_spec.file_name.native().c_str());
-                    return;
+                    return false;
                 }
-                out.exceptions(std::ifstream::failbit);
+                line_count_list_.push_back(line_count);
+            }
+            skip_full_outputs();
+            return true;
+        }
 
-                for (uintmax_t i = 0; i < line_count; i++)
-                {
-                    if (cur_index >= num_lines)
-                    {
-                        break;
-                    }
+        bool done() const
+        {
+            return output_index_ >= sink_list_.size();
+        }
+
+        void write(const CharT *s, size_t len)
+        {
+            write_part(s, len);
+            end_line();
+        }
+
+        // Writes a part of a line which is too long to be written at once.
+        // end_line() is called after the last part.
+        void write_part(const CharT *s, size_t len)
+        {
+            sink_list_[output_index_]->write(s, len);
+        }
+
+        void end_line()
+        {
+            if (--remaining_ == 0)
+            {
+                output_index_++;
+                skip_full_outputs();
+            }
+        }
+
+        void close()
+        {
+            for (auto &sink : sink_list_) sink->close();
+        }
+
+    private:
+        void skip_full_outputs()
+        {
+            while (output_index_ < sink_list_.size() && line_count_list_[output_index_] == 0)
+            {
+                output_index_++;
+            }
+            if (output_index_ < sink_list_.size())
+            {
+                remaining_ = line_count_list_[output_index_];
+            }
+        }
 
-                    size_t n = line_index_list[cur_index++];
-                    const CharT *first = line_position_list[n];
-                    const CharT *last = line_position_list[n + 1];
-                    out.write(first, last - first);
+        std::vector<std::unique_ptr<output_sink>> sink_list_;
+        std::vector<uintmax_t> line_count_list_;
+        size_t output_index_;
+        uintmax_t remaining_;
+    };
+
+    // Sends each line from the line source to a random bucket file named
+    // prefix followed by the bucket index. A newline is added to the last
+    // line if it doesn't have one. Returns the bucket file names, and the
+    // numbers of lines of the buckets in bucket_line_count_list.
+    template <typename CharT, typename Source>
+    std::vector<fs::path> scatter_lines(Source source, const fs::path &prefix, size_t num_buckets, xoshiro256 &gen, std::vector<uintmax_t> &bucket_line_count_list)
+    {
+        bucket_line_count_list.assign(num_buckets, 0);
+        std::vector<fs::path> bucket_file_name_list;
+        std::vector<std::unique_ptr<output_sink>> bucket_list;
+        for (size_t i = 0; i < num_buckets; i++)
+        {
+            bucket_file_name_list.push_back(prefix.string() + std::to_string(i));
+            bucket_list.emplace_back(new output_sink());
+            if (!bucket_list.back()->open(bucket_file_name_list.back(), false, false, SHUFFLE_BUCKET_BUFFER_SIZE))
+            {
+                throw std::ios_base::failure("Cannot open shuffle bucket file.");
+            }
+        }
+
+        source([&bucket_list, &bucket_line_count_list, num_buckets, &gen](const CharT *s, size_t len)
+        {
+            if (s == nullptr || len == 0)
+            {
+                return;
+            }
+            size_t i = static_cast<size_t>(bounded_random(gen, num_buckets));
+            auto &bucket = *bucket_list[i];
+            bucket.write(s, len);
+            if (s[len - 1] != '\n')
+            {
+                bucket.put<CharT>('\n');
+            }
+            bucket_line_count_list[i]++;
+        });
+
+        for (auto &bucket : bucket_list) bucket->close();
+        return bucket_file_name_list;
+    }
+
+    // Loads the bucket of num_lines lines into the buffer, shuffles the
+    // lines and writes them. A bucket larger than the buffer is scattered
+    // into smaller buckets. A single line larger than the buffer can't be
+    // split, so it is copied to the output as it is.
+    template <typename CharT>
+    void shuffle_bucket(const fs::path &bucket_file_name, uintmax_t num_lines, heap_vector<CharT> &heap, int num_threads, xoshiro256 &gen, shuffle_output_writer<CharT> &writer)
+    {
+        uintmax_t len = fs::file_size(bucket_file_name) / sizeof(CharT);
+        if (len > heap.size() && num_lines <= 1)
+        {
+            file_source_default(bucket_file_name, [&writer](const char *s, size_t len)
+            {
+                if (s != nullptr) writer.write_part(reinterpret_cast<const CharT *>(s), len / sizeof(CharT));
+            });
+            writer.end_line();
+            fs::remove(bucket_file_name);
+            return;
+        }
+        if (len > heap.size())
+        {
+            // No more buckets than lines, as a line is never split.
+            uintmax_t num_sub_buckets = std::min(1 + (len * 5) / (heap.size() * 4), num_lines);
+            std::vector<uintmax_t> sub_bucket_line_count_list;
+            auto sub_bucket_file_name_list = scatter_lines<CharT>([&bucket_file_name](auto callback)
+            {
+                file_line_source_default<CharT>(bucket_file_name, callback);
+            }, bucket_file_name.string() + ".", static_cast<size_t>(num_sub_buckets), gen, sub_bucket_line_count_list);
+            fs::remove(bucket_file_name);
+            for (size_t i = 0; i < sub_bucket_file_name_list.size(); i++)
+            {
+                if (!writer.done() && sub_bucket_line_count_list[i] > 0)
+                {
+                    shuffle_bucket(sub_bucket_file_name_list[i], sub_bucket_line_count_list[i], heap, num_threads, gen, writer);
                 }
+                fs::remove(sub_bucket_file_name_list[i]);
+            }
+            return;
+        }
+
+        CharT *buffer = heap.ptr();
+        {
+            fs::ifstream in(bucket_file_name, std::ios::in | std::ios::binary);
+            if (!in.is_open() || !in.read(reinterpret_cast<char *>(buffer), len * sizeof(CharT)))
+            {
+                throw std::ios_base::failure("Cannot read shuffle bucket file.");
             }
+        }
+        fs::remove(bucket_file_name);
+
+        // Every line in a bucket ends with a newline.
+        std::vector<size_t> line_position_list;
+        line_position_list.push_back(0);
+        const CharT *last = buffer + len;
+        for (const CharT *p = find_new_line(buffer, last); p != last; p = find_new_line(p + 1, last))
+        {
+            line_position_list.push_back(p + 1 - buffer);
+        }
+
+        num_lines = line_position_list.size() - 1;
+        packed_uint_vector line_index_list;
+        line_index_list.assign(static_cast<size_t>(num_lines), packed_uint_vector::width_for(num_lines));
+        random_permutation(line_index_list, gen(), num_threads);
+
+        for (size_t i = 0; i < num_lines && !writer.done(); i++)
+        {
+            size_t n = static_cast<size_t>(line_index_list.get(i));
+            writer.write(buffer + line_position_list[n], line_position_list[n + 1] - line_position_list[n]);
+        }
+
+        heap.clear();
+    }
 
-            heap.clear();
+    // Shuffles lines which don't fit in memory with two passes over the
+    // data. The first pass sends each line to one of num_buckets random
+    // bucket files. The second pass loads each bucket into the buffer,
+    // shuffles it and appends it to the outputs. As the buckets are chosen
+    // uniformly and each bucket is shuffled uniformly, the concatenation is
+    // a uniform permutation.
+    template<typename CharT>
+    void file_shuffle_lines(const std::vector<fs::path> &input_file_name_list, const std::vector<sample_output_spec> &output_spec_list, uintmax_t num_buckets, heap_vector<CharT> &heap, uint64_t seed, int num_threads)
+    {
+        xoshiro256 gen(seed);
+        temp_directory temp_dir;
+
+        std::vector<uintmax_t> bucket_line_count_list;
+        auto bucket_file_name_list = scatter_lines<CharT>([&input_file_name_list](auto callback)
+        {
+            for (auto &input_file_name : input_file_name_list)
+            {
+                std::wcout << input_file_name.native() << "\tReading" << std::endl;
+                file_line_source_default<CharT>(input_file_name, callback);
+            }
+        }, temp_dir.path() / "b", static_cast<size_t>(num_buckets), gen, bucket_line_count_list);
+        uintmax_t num_lines = std::accumulate(bucket_line_count_list.begin(), bucket_line_count_list.end(), static_cast<uintmax_t>(0));
+        std::wcout << "\tLineCount\t" << num_lines << std::endl;
+
+        shuffle_output_writer<CharT> writer;
+        if (!writer.open(output_spec_list, num_lines))
+        {
+            return;
+        }
+        for (size_t i = 0; i < bucket_file_name_list.size() && !writer.done(); i++)
+        {
+            std::wcout << "\tCurrentBucket\t" << i << std::endl;
+            shuffle_bucket(bucket_file_name_list[i], bucket_line_count_list[i], heap, num_threads, gen, writer);
         }
+        writer.close();
     }
 
+    // Reads the line after the first new line at or after offset of the
+    // file, continuing to the next file at the end of file and wrapping
+    // around at the end of the last file. If skip is false, the line at
+    // offset is read instead.
     template <typename CharT>
-    void file_quick_sample_file_lines(fs::path &input_file_name, const std::vector<sample_output_spec> &output_spec_list)
+    std::basic_string<CharT> quick_sample_read_line(const std::vector<fs::path> &file_name_list, size_t file_index, uintmax_t offset, bool skip = true)
     {
         static_assert(sizeof(CharT) == sizeof(char), "Only char type is supported.");
-        rnd::mt19937_64 gen(std::time(nullptr));
-        uintmax_t file_size = fs::file_size(input_file_name);
-        rnd::uniform_int_distribution<std::streamoff> dist(0, file_size);
-        fs::ifstream fin(input_file_name);
-        if (!fin.is_open())
+        for (size_t n = 0; n <= file_name_list.size(); n++)
         {
-            return;
+            fs::ifstream fin(file_name_list[file_index], std::ios::binary);
+            std::basic_string<CharT> line;
+            if (fin.is_open())
+            {
+                fin.seekg(offset);
+                if (skip)
+                {
+                    std::getline(fin, line);
+                }
+                if (fin && fin.peek() != std::char_traits<char>::eof())
+                {
+                    std::getline(fin, line);
+                    return line;
+                }
+            }
+            file_index = (file_index + 1) % file_name_list.size();
+            offset = 0;
+            skip = false;
         }
-        for (auto &spec : output_spec_list)
+        return std::basic_string<CharT>();
+    }
+
+    // Samples lines at random offsets of the files, so that each file is
+    // sampled by its size. When all the files have up to date indexes,
+    // lines are sampled uniformly by the line numbers instead. All the
+    // offsets are drawn first and read in the order of the offsets with
+    // several reads in flight, then the lines are written in the order
+    // they were drawn.
+    template <typename CharT>
+    void file_quick_sample_file_lines(const std::vector<fs::path> &input_file_name_list, const std::vector<sample_output_spec> &output_spec_list, uint64_t seed)
+    {
+        static_assert(sizeof(CharT) == sizeof(char), "Only char type is supported.");
+
+        // Empty files have no offsets to draw.
+        std::vector<fs::path> file_name_list;
+        std::vector<uintmax_t> file_offset_list;
+        std::vector<std::unique_ptr<line_index>> index_list;
+        std::vector<uintmax_t> file_line_offset_list;
+        bool line_mode = true;
+        uintmax_t total_size = 0;
+        uintmax_t total_lines = 0;
+        for (auto &input_file_name : input_file_name_list)
+        {
+            uintmax_t file_size = fs::file_size(input_file_name);
+            if (file_size > 0)
+            {
+                file_name_list.push_back(input_file_name);
+                file_offset_list.push_back(total_size);
+                total_size += file_size;
+                if (line_mode)
+                {
+                    index_list.emplace_back(new line_index());
+                    line_mode = index_list.back()->open(input_file_name);
+                    file_line_offset_list.push_back(total_lines);
+                    total_lines += index_list.back()->line_count();
+                }
+            }
+        }
+        file_offset_list.push_back(total_size);
+        file_line_offset_list.push_back(total_lines);
+
+        size_t num_samples = 0;
+        if (total_size > 0)
         {
-            std::vector<std::basic_string<CharT>> line_list;
-            for (int i = 0; i < spec.number_of_lines; i++)
+            for (auto &spec : output_spec_list)
             {
-                uintmax_t pos = dist(gen);
-                fin.seekg(pos);
-                std::basic_string<CharT> line;
-                std::getline(fin, line);
-                if (fin.eof())
+                num_samples += static_cast<size_t>(spec.number_of_lines);
+            }
+        }
+        xoshiro256 gen(seed);
+        std::vector<uintmax_t> offset_list(num_samples);
+        std::vector<uintmax_t> line_size_list;
+        if (line_mode)
+        {
+            std::wcout << "\tLineIndex\t" << total_lines << std::endl;
+            line_size_list.resize(num_samples);
+            for (size_t i = 0; i < num_samples; i++)
+            {
+                uintmax_t n = bounded_random(gen, total_lines);
+                size_t file_index = std::upper_bound(file_line_offset_list.begin(), file_line_offset_list.end(), n) - file_line_offset_list.begin() - 1;
+                n -= file_line_offset_list[file_index];
+                offset_list[i] = file_offset_list[file_index] + index_list[file_index]->offset(n);
+                line_size_list[i] = index_list[file_index]->line_size(n);
+            }
+        }
+        else
+        {
+            for (auto &offset : offset_list)
+            {
+                offset = bounded_random(gen, total_size);
+            }
+        }
+        std::vector<size_t> order_list(num_samples);
+        std::iota(order_list.begin(), order_list.end(), 0);
+        std::sort(order_list.begin(), order_list.end(), [&offset_list](size_t x, size_t y) { return offset_list[x] < offset_list[y]; });
+
+        std::vector<std::basic_string<CharT>> line_list(num_samples);
+        // The samples whose lines are not in the bytes read.
+        std::vector<size_t> slow_sample_list;
+        size_t k = 0;
+        for (size_t file_index = 0; file_index < file_name_list.size(); file_index++)
+        {
+            uintmax_t file_first = file_offset_list[file_index];
+            uintmax_t file_size = file_offset_list[file_index + 1] - file_first;
+            std::vector<file_range> range_list;
+            std::vector<size_t> sample_list;
+            for (; k < num_samples && offset_list[order_list[k]] < file_first + file_size; k++)
+            {
+                uintmax_t offset = offset_list[order_list[k]] - file_first;
+                uintmax_t size = line_mode ? line_size_list[order_list[k]] : file_size - offset;
+                if (line_mode && offset > 0)
                 {
-                    fin.clear();
-                    fin.seekg(0);
+                    // The new line before the line is read to check it.
+                    offset--;
+                    size++;
                 }
-                std::getline(fin, line);
-                if (fin.eof())
+                range_list.push_back(file_range{ offset, static_cast<size_t>(std::min<uintmax_t>(QUICK_SAMPLE_READ_SIZE, size)) });
+                sample_list.push_back(order_list[k]);
+            }
+            bool success = file_batch_range_source(file_name_list[file_index], range_list, [&](size_t i, const char *_s, size_t _len)
+            {
+                const CharT *s = reinterpret_cast<const CharT *>(_s);
+                const CharT *last = s + _len / sizeof(CharT);
+                if (line_mode)
                 {
-                    fin.clear();
+                    // The file may have been rewritten within the tick of
+                    // its write time, so the line must follow a new line,
+                    // and end with its only new line or at the end of the
+                    // file.
+                    const CharT *first = s;
+                    if (offset_list[sample_list[i]] > file_first)
+                    {
+                        first = s != last && *s == '\n' ? s + 1 : last;
+                    }
+                    const CharT *p = find_new_line(first, last);
+                    bool at_end = range_list[i].offset + _len == file_size;
+                    if (static_cast<uintmax_t>(last - first) == line_size_list[sample_list[i]] && first != last && (p + 1 == last || (p == last && at_end)))
+                    {
+                        line_list[sample_list[i]].assign(first, p);
+                    }
+                    else
+                    {
+                        slow_sample_list.push_back(sample_list[i]);
+                    }
+                    return;
                 }
-                line_list.push_back(std::move(line));
+                const CharT *p = find_new_line(s, last);
+                if (p != last)
+                {
+                    const CharT *line_end = find_new_line(p + 1, last);
+                    bool at_end = range_list[i].offset + _len == file_size;
+                    if (line_end != last || (at_end && p + 1 != last))
+                    {
+                        line_list[sample_list[i]].assign(p + 1, line_end);
+                        return;
+                    }
+                }
+                slow_sample_list.push_back(sample_list[i]);
+            });
+            if (!success)
+            {
+                return;
+            }
+        }
+        for (size_t i : slow_sample_list)
+        {
+            size_t file_index = std::upper_bound(file_offset_list.begin(), file_offset_list.end(), offset_list[i]) - file_offset_list.begin() - 1;
+            if (line_mode)
+            {
+                // The line is read from the new line before it, so that a
+                // whole line is read even if the index is of an older file
+                // rewritten within the tick of its write time.
+                uintmax_t offset = offset_list[i] - file_offset_list[file_index];
+                line_list[i] = quick_sample_read_line<CharT>(file_name_list, file_index, offset == 0 ? 0 : offset - 1, offset != 0);
+            }
+            else
+            {
+                line_list[i] = quick_sample_read_line<CharT>(file_name_list, file_index, offset_list[i] - file_offset_list[file_index]);
+            }
+        }
+
+        size_t index = 0;
+        for (auto &spec : output_spec_list)
+        {
+            output_sink fout;
+            if (!fout.open(spec.file_name))
+            {
+                std::wcerr << __wcserror(spec.file_name.native().c_str());
+                return;
             }
-            fs::ofstream fout(spec.file_name, std::ios::out | std::ios::binary);
-            for (auto &line : line_list)
+            for (uintmax_t i = 0; i < spec.number_of_lines && index < line_list.size(); i++)
             {
-                fout << line << '\n';
+                auto &line = line_list[index++];
+                fout.write(line.data(), line.size());
+                fout.put<CharT>('\n');
             }
+            fout.close();
         }
     }
 }
\ No newline at end of file
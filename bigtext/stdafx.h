@@ -2,11 +2,13 @@
 
 #define NOMINMAX 1
 
+#ifdef _WIN32
 #include "targetver.h"
 
 #include <Windows.h>
 
 #include <tchar.h>
+#endif
 #include <cstdint>
 #include <cassert>
 
@@ -14,11 +16,21 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <queue>
 #include <unordered_map>
 #include <new>
 #include <memory>
 #include <iomanip>
 #include <functional>
+#include <numeric>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <exception>
 
 #include <boost/filesystem.hpp>
 #include <boost/random.hpp>
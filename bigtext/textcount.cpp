@@ -0,0 +1,144 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "textcount.h"
+#include "textscan.h"
+
+namespace bigtext
+{
+    text_counter::text_counter() : in_word_(false), last_char_('\n'), need_(0), next_min_(0x80), next_max_(0xbf)
+    {
+        std::memset(&count_, 0, sizeof count_);
+    }
+
+    void text_counter::update(const char *s, size_t len)
+    {
+        if (len == 0)
+        {
+            return;
+        }
+        count_.byte_count += len;
+
+        // A word starts at a character which is not a white space after a
+        // white space.
+        size_t num_blocks = (len + 63) / 64;
+        if (white_space_mask_list_.size() < num_blocks)
+        {
+            white_space_mask_list_.resize(num_blocks);
+            line_mask_list_.resize(num_blocks);
+        }
+        classify_white_space(s, len, '\n', '\n', white_space_mask_list_.data(), nullptr, line_mask_list_.data());
+        for (size_t b = 0; b < num_blocks; b++)
+        {
+            size_t n = std::min<size_t>(len - b * 64, 64);
+            uint64_t valid_mask = n == 64 ? ~0ULL : (1ULL << n) - 1;
+            uint64_t w = white_space_mask_list_[b];
+            uint64_t after_white_space = (w << 1) | (in_word_ ? 0 : 1);
+            count_.word_count += count_bits(~w & after_white_space & valid_mask);
+            count_.line_count += count_bits(line_mask_list_[b]);
+            in_word_ = ((w >> (n - 1)) & 1) == 0;
+        }
+        last_char_ = s[len - 1];
+
+        // ASCII characters are skipped in vectors.
+        const char *p = s;
+        const char *last = s + len;
+        while (p != last)
+        {
+            if (need_ == 0)
+            {
+                const char *q = find_non_ascii(p, last);
+                count_.char_count += q - p;
+                p = q;
+                if (p == last)
+                {
+                    break;
+                }
+            }
+            decode(static_cast<unsigned char>(*p++));
+        }
+    }
+
+    // Follows the well-formed byte sequences of the Unicode standard. A
+    // character is counted at its first byte.
+    void text_counter::decode(unsigned char ch)
+    {
+        if (need_ > 0)
+        {
+            if (ch >= next_min_ && ch <= next_max_)
+            {
+                need_--;
+                next_min_ = 0x80;
+                next_max_ = 0xbf;
+                return;
+            }
+            // The sequence is cut before ch.
+            count_.malformed_count++;
+            need_ = 0;
+        }
+        count_.char_count++;
+        if (ch < 0x80)
+        {
+            return;
+        }
+        next_min_ = 0x80;
+        next_max_ = 0xbf;
+        if (ch >= 0xc2 && ch <= 0xdf)
+        {
+            need_ = 1;
+        }
+        else if (ch >= 0xe0 && ch <= 0xef)
+        {
+            need_ = 2;
+            // No overlong forms and no surrogates.
+            if (ch == 0xe0) next_min_ = 0xa0;
+            if (ch == 0xed) next_max_ = 0x9f;
+        }
+        else if (ch >= 0xf0 && ch <= 0xf4)
+        {
+            need_ = 3;
+            // No overlong forms and nothing above U+10FFFF.
+            if (ch == 0xf0) next_min_ = 0x90;
+            if (ch == 0xf4) next_max_ = 0x8f;
+        }
+        else
+        {
+            count_.malformed_count++;
+        }
+    }
+
+    void text_counter::finish()
+    {
+        if (need_ > 0)
+        {
+            count_.malformed_count++;
+            need_ = 0;
+        }
+        if (last_char_ != '\n')
+        {
+            count_.line_count++;
+            last_char_ = '\n';
+        }
+    }
+
+    void text_counter::merge(const text_counter &other)
+    {
+        count_.byte_count += other.count_.byte_count;
+        count_.line_count += other.count_.line_count;
+        count_.word_count += other.count_.word_count;
+        count_.char_count += other.count_.char_count;
+        count_.malformed_count += other.count_.malformed_count;
+        if (other.count_.byte_count > 0)
+        {
+            in_word_ = other.in_word_;
+            last_char_ = other.last_char_;
+            need_ = other.need_;
+            next_min_ = other.next_min_;
+            next_max_ = other.next_max_;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    struct text_count
+    {
+        uintmax_t byte_count;
+        uintmax_t line_count;
+        uintmax_t word_count;
+        uintmax_t char_count;
+        uintmax_t malformed_count;
+    };
+
+    // Counts bytes, lines, white space delimited words and UTF-8
+    // characters of text like wc in a single pass. A malformed UTF-8
+    // sequence is counted as a malformed sequence and as a character, as
+    // if it were replaced with U+FFFD.
+    class text_counter
+    {
+    public:
+        text_counter();
+
+        void update(const char *s, size_t len);
+        // Ends the text. A last line without a new line is counted.
+        void finish();
+        // Adds the counts of the text which follows this text. The other
+        // text must start at a line.
+        void merge(const text_counter &other);
+
+        const text_count &count() const
+        {
+            return count_;
+        }
+
+    private:
+        void decode(unsigned char ch);
+
+        text_count count_;
+        bool in_word_;
+        char last_char_;
+        // Continuation bytes expected and the range of the next one.
+        int need_;
+        unsigned char next_min_;
+        unsigned char next_max_;
+        std::vector<uint64_t> white_space_mask_list_;
+        std::vector<uint64_t> line_mask_list_;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,419 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#include "stdafx.h"
+
+#include "bigtext.h"
+#include "textscan.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define BIGTEXT_SIMD_X64 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BIGTEXT_TARGET(x) __attribute__((target(x)))
+#else
+#define BIGTEXT_TARGET(x)
+#endif
+
+namespace bigtext
+{
+    enum class simd_level
+    {
+        scalar,
+        sse2,
+        avx2,
+        avx512,
+    };
+
+    static size_t count_new_lines_scalar(const char *s, size_t len)
+    {
+        size_t c = 0;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (s[i] == '\n') c++;
+        }
+        return c;
+    }
+
+    static const char *find_new_line_scalar(const char *first, const char *last)
+    {
+        while (first != last && *first != '\n')
+        {
+            ++first;
+        }
+        return first;
+    }
+
+    static const char *find_non_ascii_scalar(const char *first, const char *last)
+    {
+        while (first != last && static_cast<unsigned char>(*first) < 0x80)
+        {
+            ++first;
+        }
+        return first;
+    }
+
+    static void classify_white_space_scalar(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask)
+    {
+        classify_white_space<char>(s, len, column_separator, line_separator, white_space_mask, column_mask, line_mask);
+    }
+
+#ifdef BIGTEXT_SIMD_X64
+
+    BIGTEXT_TARGET("sse2")
+    static size_t count_new_lines_sse2(const char *s, size_t len)
+    {
+        const __m128i nl = _mm_set1_epi8('\n');
+        size_t c = 0;
+        size_t i = 0;
+        while (len - i >= 16)
+        {
+            // Each byte counter can hold up to 255 matches.
+            size_t n = std::min<size_t>((len - i) / 16, 255);
+            __m128i acc = _mm_setzero_si128();
+            for (size_t k = 0; k < n; k++, i += 16)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+                acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+            }
+            __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+            c += static_cast<size_t>(_mm_cvtsi128_si32(sum)) + static_cast<size_t>(_mm_extract_epi16(sum, 4));
+        }
+        return c + count_new_lines_scalar(s + i, len - i);
+    }
+
+    BIGTEXT_TARGET("sse2")
+    static const char *find_new_line_sse2(const char *first, const char *last)
+    {
+        const __m128i nl = _mm_set1_epi8('\n');
+        while (last - first >= 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+            unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+            if (mask != 0)
+            {
+                return first + count_trailing_zeros(mask);
+            }
+            first += 16;
+        }
+        return find_new_line_scalar(first, last);
+    }
+
+    BIGTEXT_TARGET("sse2")
+    static const char *find_non_ascii_sse2(const char *first, const char *last)
+    {
+        while (last - first >= 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+            unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(v));
+            if (mask != 0)
+            {
+                return first + count_trailing_zeros(mask);
+            }
+            first += 16;
+        }
+        return find_non_ascii_scalar(first, last);
+    }
+
+    // The tail shorter than 64 characters is left to the scalar version.
+    BIGTEXT_TARGET("sse2")
+    static void classify_white_space_sse2(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask)
+    {
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i col = _mm_set1_epi8(column_separator);
+        const __m128i line = _mm_set1_epi8(line_separator);
+        size_t b = 0;
+        for (; (b + 1) * 64 <= len; b++)
+        {
+            uint64_t w = 0, c = 0, l = 0;
+            for (int k = 0; k < 4; k++)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + b * 64 + k * 16));
+                // Unsigned v <= ' ' is the same as is_white_space.
+                w |= static_cast<uint64_t>(static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, space), v)))) << (k * 16);
+                c |= static_cast<uint64_t>(static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, col)))) << (k * 16);
+                l |= static_cast<uint64_t>(static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, line)))) << (k * 16);
+            }
+            white_space_mask[b] = w;
+            if (column_mask != nullptr) column_mask[b] = c;
+            if (line_mask != nullptr) line_mask[b] = l;
+        }
+        if (b * 64 < len)
+        {
+            classify_white_space_scalar(s + b * 64, len - b * 64, column_separator, line_separator, white_space_mask + b,
+                column_mask != nullptr ? column_mask + b : nullptr, line_mask != nullptr ? line_mask + b : nullptr);
+        }
+    }
+
+    BIGTEXT_TARGET("avx2")
+    static size_t count_new_lines_avx2(const char *s, size_t len)
+    {
+        const __m256i nl = _mm256_set1_epi8('\n');
+        size_t c = 0;
+        size_t i = 0;
+        while (len - i >= 32)
+        {
+            size_t n = std::min<size_t>((len - i) / 32, 255);
+            __m256i acc = _mm256_setzero_si256();
+            for (size_t k = 0; k < n; k++, i += 32)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+                acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+            }
+            __m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+            alignas(32) uint64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), sum);
+            c += static_cast<size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+        }
+        return c + count_new_lines_sse2(s + i, len - i);
+    }
+
+    BIGTEXT_TARGET("avx2")
+    static const char *find_new_line_avx2(const char *first, const char *last)
+    {
+        const __m256i nl = _mm256_set1_epi8('\n');
+        while (last - first >= 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+            unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+            if (mask != 0)
+            {
+                return first + count_trailing_zeros(mask);
+            }
+            first += 32;
+        }
+        return find_new_line_sse2(first, last);
+    }
+
+    BIGTEXT_TARGET("avx2")
+    static const char *find_non_ascii_avx2(const char *first, const char *last)
+    {
+        while (last - first >= 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+            unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(v));
+            if (mask != 0)
+            {
+                return first + count_trailing_zeros(mask);
+            }
+            first += 32;
+        }
+        return find_non_ascii_sse2(first, last);
+    }
+
+    BIGTEXT_TARGET("avx2")
+    static void classify_white_space_avx2(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask)
+    {
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i col = _mm256_set1_epi8(column_separator);
+        const __m256i line = _mm256_set1_epi8(line_separator);
+        size_t b = 0;
+        for (; (b + 1) * 64 <= len; b++)
+        {
+            uint64_t w = 0, c = 0, l = 0;
+            for (int k = 0; k < 2; k++)
+            {
+                __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + b * 64 + k * 32));
+                w |= static_cast<uint64_t>(static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, space), v)))) << (k * 32);
+                c |= static_cast<uint64_t>(static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, col)))) << (k * 32);
+                l |= static_cast<uint64_t>(static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, line)))) << (k * 32);
+            }
+            white_space_mask[b] = w;
+            if (column_mask != nullptr) column_mask[b] = c;
+            if (line_mask != nullptr) line_mask[b] = l;
+        }
+        if (b * 64 < len)
+        {
+            classify_white_space_scalar(s + b * 64, len - b * 64, column_separator, line_separator, white_space_mask + b,
+                column_mask != nullptr ? column_mask + b : nullptr, line_mask != nullptr ? line_mask + b : nullptr);
+        }
+    }
+
+    BIGTEXT_TARGET("avx512f,avx512bw,popcnt")
+    static size_t count_new_lines_avx512(const char *s, size_t len)
+    {
+        const __m512i nl = _mm512_set1_epi8('\n');
+        size_t c = 0;
+        size_t i = 0;
+        for (; len - i >= 64; i += 64)
+        {
+            __m512i v = _mm512_loadu_si512(reinterpret_cast<const void *>(s + i));
+            c += static_cast<size_t>(_mm_popcnt_u64(_mm512_cmpeq_epi8_mask(v, nl)));
+        }
+        return c + count_new_lines_avx2(s + i, len - i);
+    }
+
+    BIGTEXT_TARGET("avx512f,avx512bw")
+    static const char *find_new_line_avx512(const char *first, const char *last)
+    {
+        const __m512i nl = _mm512_set1_epi8('\n');
+        while (last - first >= 64)
+        {
+            __m512i v = _mm512_loadu_si512(reinterpret_cast<const void *>(first));
+            uint64_t mask = _mm512_cmpeq_epi8_mask(v, nl);
+            if (mask != 0)
+            {
+                return first + count_trailing_zeros(mask);
+            }
+            first += 64;
+        }
+        return find_new_line_avx2(first, last);
+    }
+
+    BIGTEXT_TARGET("avx512f,avx512bw")
+    static const char *find_non_ascii_avx512(const char *first, const char *last)
+    {
+        while (last - first >= 64)
+        {
+            __m512i v = _mm512_loadu_si512(reinterpret_cast<const void *>(first));
+            uint64_t mask = _mm512_movepi8_mask(v);
+            if (mask != 0)
+            {
+                return first + count_trailing_zeros(mask);
+            }
+            first += 64;
+        }
+        return find_non_ascii_avx2(first, last);
+    }
+
+    BIGTEXT_TARGET("avx512f,avx512bw")
+    static void classify_white_space_avx512(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask)
+    {
+        const __m512i space = _mm512_set1_epi8(' ');
+        const __m512i col = _mm512_set1_epi8(column_separator);
+        const __m512i line = _mm512_set1_epi8(line_separator);
+        size_t b = 0;
+        for (; (b + 1) * 64 <= len; b++)
+        {
+            __m512i v = _mm512_loadu_si512(reinterpret_cast<const void *>(s + b * 64));
+            white_space_mask[b] = _mm512_cmple_epu8_mask(v, space);
+            if (column_mask != nullptr) column_mask[b] = _mm512_cmpeq_epi8_mask(v, col);
+            if (line_mask != nullptr) line_mask[b] = _mm512_cmpeq_epi8_mask(v, line);
+        }
+        if (b * 64 < len)
+        {
+            classify_white_space_scalar(s + b * 64, len - b * 64, column_separator, line_separator, white_space_mask + b,
+                column_mask != nullptr ? column_mask + b : nullptr, line_mask != nullptr ? line_mask + b : nullptr);
+        }
+    }
+
+    static simd_level detect_simd_level()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        int max_leaf = info[0];
+        __cpuid(info, 1);
+        bool has_sse2 = (info[3] & (1 << 26)) != 0;
+        bool has_osxsave = (info[2] & (1 << 27)) != 0;
+        bool has_avx = (info[2] & (1 << 28)) != 0;
+        if (!has_sse2) return simd_level::scalar;
+        if (!has_osxsave || !has_avx || max_leaf < 7) return simd_level::sse2;
+        unsigned long long xcr0 = _xgetbv(0);
+        if ((xcr0 & 0x6) != 0x6) return simd_level::sse2;
+        __cpuidex(info, 7, 0);
+        bool has_avx2 = (info[1] & (1 << 5)) != 0;
+        bool has_avx512 = (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0 && (xcr0 & 0xe6) == 0xe6;
+        if (has_avx512) return simd_level::avx512;
+        if (has_avx2) return simd_level::avx2;
+        return simd_level::sse2;
+#else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return simd_level::avx512;
+        if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+        if (__builtin_cpu_supports("sse2")) return simd_level::sse2;
+        return simd_level::scalar;
+#endif
+    }
+#else
+    static simd_level detect_simd_level()
+    {
+        return simd_level::scalar;
+    }
+#endif
+
+    // BIGTEXT_SIMD=scalar|sse2|avx2 limits the kernels, which is useful
+    // to compare them.
+    static simd_level get_simd_level()
+    {
+        simd_level level = detect_simd_level();
+        const char *env = std::getenv("BIGTEXT_SIMD");
+        if (env != nullptr)
+        {
+            std::string name(env);
+            simd_level max_level = name == "scalar" ? simd_level::scalar
+                : name == "sse2" ? simd_level::sse2
+                : name == "avx2" ? simd_level::avx2
+                : simd_level::avx512;
+            if (level > max_level) level = max_level;
+        }
+        return level;
+    }
+
+    struct scan_kernels
+    {
+        size_t (*count_new_lines)(const char *s, size_t len);
+        const char *(*find_new_line)(const char *first, const char *last);
+        const char *(*find_non_ascii)(const char *first, const char *last);
+        void (*classify_white_space)(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask);
+    };
+
+    static scan_kernels select_scan_kernels()
+    {
+        scan_kernels k = { count_new_lines_scalar, find_new_line_scalar, find_non_ascii_scalar, classify_white_space_scalar };
+#ifdef BIGTEXT_SIMD_X64
+        switch (get_simd_level())
+        {
+        case simd_level::avx512:
+            k.count_new_lines = count_new_lines_avx512;
+            k.find_new_line = find_new_line_avx512;
+            k.find_non_ascii = find_non_ascii_avx512;
+            k.classify_white_space = classify_white_space_avx512;
+            break;
+        case simd_level::avx2:
+            k.count_new_lines = count_new_lines_avx2;
+            k.find_new_line = find_new_line_avx2;
+            k.find_non_ascii = find_non_ascii_avx2;
+            k.classify_white_space = classify_white_space_avx2;
+            break;
+        case simd_level::sse2:
+            k.count_new_lines = count_new_lines_sse2;
+            k.find_new_line = find_new_line_sse2;
+            k.find_non_ascii = find_non_ascii_sse2;
+            k.classify_white_space = classify_white_space_sse2;
+            break;
+        default:
+            break;
+        }
+#endif
+        return k;
+    }
+
+    static const scan_kernels kernels = select_scan_kernels();
+
+    size_t count_new_lines(const char *s, size_t len)
+    {
+        return kernels.count_new_lines(s, len);
+    }
+
+    const char *find_new_line(const char *first, const char *last)
+    {
+        return kernels.find_new_line(first, last);
+    }
+
+    const char *find_non_ascii(const char *first, const char *last)
+    {
+        return kernels.find_non_ascii(first, last);
+    }
+
+    void classify_white_space(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask)
+    {
+        kernels.classify_white_space(s, len, column_separator, line_separator, white_space_mask, column_mask, line_mask);
+    }
+}
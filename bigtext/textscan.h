@@ -0,0 +1,130 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace bigtext
+{
+    // Vectorized scanning kernels for char. The best of AVX-512, AVX2 and
+    // SSE2 is selected at run time, and other character types use the
+    // scalar templates below.
+
+    size_t count_new_lines(const char *s, size_t len);
+    const char *find_new_line(const char *first, const char *last);
+    // Returns the first character which is not ASCII, or last.
+    const char *find_non_ascii(const char *first, const char *last);
+
+    // Fills one bit per character for each 64 characters. Bits beyond len
+    // are zero. column_mask and line_mask may be null.
+    void classify_white_space(const char *s, size_t len, char column_separator, char line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask);
+
+    // x must not be zero.
+    inline int count_trailing_zeros(uint64_t x)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanForward64(&index, x);
+        return static_cast<int>(index);
+#elif defined(_MSC_VER)
+        // _BitScanForward64 is only on x64.
+        unsigned long index;
+        if (_BitScanForward(&index, static_cast<unsigned long>(x)))
+        {
+            return static_cast<int>(index);
+        }
+        _BitScanForward(&index, static_cast<unsigned long>(x >> 32));
+        return static_cast<int>(index) + 32;
+#else
+        return __builtin_ctzll(x);
+#endif
+    }
+
+    // The scalar and SSE2 kernels run on CPUs without POPCNT, which MSVC
+    // would emit for __popcnt64, so the bits are added in parallel there.
+    // GCC emits POPCNT only when the target has it.
+    inline int count_bits(uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(x);
+#else
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+#endif
+    }
+
+    template <typename CharT>
+    size_t count_new_lines(const CharT *s, size_t len)
+    {
+        size_t c = 0;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (is_new_line(s[i])) c++;
+        }
+        return c;
+    }
+
+    template <typename CharT>
+    const CharT *find_new_line(const CharT *first, const CharT *last)
+    {
+        while (first != last && !is_new_line(*first))
+        {
+            ++first;
+        }
+        return first;
+    }
+
+    static const size_t SKIP_NEW_LINES_BLOCK_SIZE = 4096;
+
+    // Returns the position after the n-th new line from first, or last if
+    // there are fewer, and decreases n by the new lines passed. Blocks with
+    // fewer new lines than n are passed by counting them.
+    template <typename CharT>
+    const CharT *skip_new_lines(const CharT *first, const CharT *last, uintmax_t &n)
+    {
+        while (n > 0 && first != last)
+        {
+            size_t len = std::min<size_t>(last - first, SKIP_NEW_LINES_BLOCK_SIZE);
+            size_t c = count_new_lines(first, len);
+            if (c < n)
+            {
+                n -= c;
+                first += len;
+                continue;
+            }
+            while (n > 0)
+            {
+                first = find_new_line(first, last) + 1;
+                n--;
+            }
+        }
+        return first;
+    }
+
+    template <typename CharT>
+    void classify_white_space(const CharT *s, size_t len, CharT column_separator, CharT line_separator, uint64_t *white_space_mask, uint64_t *column_mask, uint64_t *line_mask)
+    {
+        for (size_t b = 0; b * 64 < len; b++)
+        {
+            const CharT *block = s + b * 64;
+            size_t n = std::min<size_t>(len - b * 64, 64);
+            uint64_t w = 0, c = 0, l = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                uint64_t bit = 1ULL << i;
+                if (is_white_space(block[i])) w |= bit;
+                if (block[i] == column_separator) c |= bit;
+                if (block[i] == line_separator) l |= bit;
+            }
+            white_space_mask[b] = w;
+            if (column_mask != nullptr) column_mask[b] = c;
+            if (line_mask != nullptr) line_mask[b] = l;
+        }
+    }
+}
@@ -13,12 +13,17 @@ namespace bigtext
 
     static int vocab_usage()
     {
-        std::wcout << "Usage: bigtext vocab [OPTION]... INPUTFILE... [[-o|-m COLUMN] OUTPUTFILE]..." << std::endl;
+        std::wcout << "Usage: bigtext vocab [OPTION]... INPUTFILE... [[-o|-c COLUMN] OUTPUTFILE]..." << std::endl;
         std::wcout << "Count words in the files and make vocabulary list." << std::endl;
         std::wcout << std::endl;
+        std::wcout << " -a         count the top words approximately in fixed memory with -k" << std::endl;
         std::wcout << " -f         force overwrite output files" << std::endl;
         std::wcout << " -h         show this help message" << std::endl;
-        std::wcout << " INPUTFILE  input file" << std::endl;
+        std::wcout << " -k K       output only the top K words" << std::endl;
+        std::wcout << " -m COUNT   output only words which occur at least COUNT times" << std::endl;
+        std::wcout << " -M MBYTES  limit memory for word counts to MBYTES megabytes" << std::endl;
+        std::wcout << " -t N       use N threads" << std::endl;
+        std::wcout << " INPUTFILE  input file, directory, pattern or @LISTFILE" << std::endl;
         std::wcout << " -o         count words in all columns" << std::endl;
         std::wcout << " -c COLUMN  count words in COLUMN-th column" << std::endl;
         std::wcout << " OUTPUTFILE output file" << std::endl;
@@ -32,6 +37,11 @@ namespace bigtext
         bool force_overwrite = false;
         bool shuffle_output = false;
         bool has_output_all = false;
+        uintmax_t num_threads = get_default_num_threads();
+        uintmax_t memory_budget = 0;
+        uintmax_t top_k = 0;
+        uintmax_t min_count = 0;
+        bool approximate = false;
         std::vector<fs::path> input_file_name_list;
         std::vector<vocab_output_spec> output_spec_list;
 
@@ -57,15 +67,25 @@ namespace bigtext
                 return 1;
             }
 
+            wchar_t number_option = '\0';
             while (*p != '\0')
             {
                 switch (*p)
                 {
+                case 'a':
+                    approximate = true;
+                    break;
                 case 'f':
                     force_overwrite = true;
                     break;
                 case 'h':
                     return vocab_usage();
+                case 'k':
+                case 'm':
+                case 'M':
+                case 't':
+                    number_option = *p;
+                    break;
                 case 'c':
                 case 'o':
                     std::wcerr << "No input files." << std::endl;
@@ -75,6 +95,65 @@ namespace bigtext
                     return 1;
                 }
                 ++p;
+
+                if (number_option != '\0')
+                {
+                    if (*p == '\0')
+                    {
+                        if (optind >= argc)
+                        {
+                            if (number_option == 't')
+                            {
+                                std::wcerr << "Number of threads is expected." << std::endl;
+                            }
+                            else if (number_option == 'M')
+                            {
+                                std::wcerr << "Memory size is expected." << std::endl;
+                            }
+                            else
+                            {
+                                std::wcerr << "Number is expected." << std::endl;
+                            }
+                            return 1;
+                        }
+                        p = argv[optind++];
+                    }
+
+                    if (number_option == 't')
+                    {
+                        if (!try_parse_number(p, num_threads) || num_threads > INT_MAX)
+                        {
+                            std::wcerr << "Invalid number of threads." << std::endl;
+                            return 1;
+                        }
+                    }
+                    else if (number_option == 'M')
+                    {
+                        if (!try_parse_number(p, memory_budget) || memory_budget > UINTMAX_MAX / (1024 * 1024))
+                        {
+                            std::wcerr << "Invalid memory size." << std::endl;
+                            return 1;
+                        }
+                        memory_budget *= 1024 * 1024;
+                    }
+                    else if (number_option == 'k')
+                    {
+                        if (!try_parse_number(p, top_k))
+                        {
+                            std::wcerr << "Invalid number of words." << std::endl;
+                            return 1;
+                        }
+                    }
+                    else
+                    {
+                        if (!try_parse_number(p, min_count))
+                        {
+                            std::wcerr << "Invalid count." << std::endl;
+                            return 1;
+                        }
+                    }
+                    break;
+                }
             }
         }
 
@@ -97,13 +176,19 @@ namespace bigtext
             return 1;
         }
 
+        if (approximate && top_k == 0)
+        {
+            std::wcerr << "-a requires -k." << std::endl;
+            return 1;
+        }
+
         while (optind < argc)
         {
             const wchar_t *p = argv[optind++];
             bool next_is_number = false;
             if (*p++ != '-')
             {
-                std::wcerr << "-m or -o is expected." << std::endl;
+                std::wcerr << "-c or -o is expected." << std::endl;
                 return 1;
             }
 
@@ -192,8 +277,9 @@ namespace bigtext
             return 1;
         }
 
-        // Verify all the input files exist
-        if (!check_input_files(input_file_name_list))
+        // Expand the directories, patterns and lists, and verify all the
+        // input files exist.
+        if (!expand_input_files(input_file_name_list, static_cast<int>(num_threads)))
         {
             return 1;
         }
@@ -211,6 +297,18 @@ namespace bigtext
 
         int status;
 
+        vocab_options options;
+        options.num_threads = static_cast<int>(num_threads);
+        options.memory_budget = memory_budget;
+        options.top_k = top_k;
+        options.min_count = min_count;
+        options.approximate = approximate;
+        if (options.memory_budget == 0 && !approximate)
+        {
+            // Words that don't fit in memory are spilled to temporary files.
+            options.memory_budget = get_physical_memory_size() * 6 / 10;
+        }
+
         boost::timer::cpu_timer timer;
 
         if (output_spec_list.size() == 1)
@@ -219,20 +317,20 @@ namespace bigtext
             {
                 // Count all columns.
                 auto &file_name = output_spec_list[0].file_name;
-                file_count_vocab<char>(input_file_name_list, file_name);
+                file_count_vocab<char>(input_file_name_list, file_name, options);
                 status = 0;
             }
             else
             {
                 // Count one column.
-                file_count_vocab<char>(input_file_name_list, output_spec_list[0]);
+                file_count_vocab<char>(input_file_name_list, output_spec_list[0], options);
                 status = 0;
             }
         }
         else
         {
             // Count specified columns.
-            file_count_vocab<char>(input_file_name_list, output_spec_list);
+            file_count_vocab<char>(input_file_name_list, output_spec_list, options);
             status = 0;
         }
 
@@ -5,6 +5,12 @@
 #pragma once
 
 #include "filesource.h"
+#include "filework.h"
+#include "vocabtable.h"
+#include "parallel.h"
+#include "vocabspill.h"
+#include "vocabtopk.h"
+#include "outputsink.h"
 
 namespace bigtext
 {
@@ -21,129 +27,354 @@ namespace bigtext
         vocab_output_spec(const fs::path &file_name, int column) : file_name(file_name), column(column) {}
     };
 
-    template <typename CharT, typename StringT = std::basic_string<CharT>>
-    bool write_vocab_count(const std::unordered_map<StringT, uintmax_t> &vocab_count, const fs::path &output_file_name)
+    struct vocab_options
     {
-        using StringCountT = std::pair<StringT, uintmax_t>;
-        std::vector<StringCountT> sorted_key_value(vocab_count.cbegin(), vocab_count.cend());
-        std::sort(sorted_key_value.begin(), sorted_key_value.end(), [](const StringCountT &x, const StringCountT &y)
+        int num_threads;
+        uintmax_t memory_budget; // Bytes for the counts. 0 for no limit.
+        uintmax_t top_k; // Number of the most frequent words to output. 0 for all.
+        uintmax_t min_count; // Minimum count of words to output.
+        bool approximate; // Count the top_k words approximately in fixed memory.
+
+        vocab_options() : num_threads(1), memory_budget(0), top_k(0), min_count(0), approximate(false) {}
+    };
+
+    static const uintmax_t VOCAB_RANGE_SIZE = 64 * 1024 * 1024;
+
+    template <typename CharT>
+    using vocab_table_list = std::vector<std::unique_ptr<vocab_table<CharT>>>;
+
+    // Writes the words in the tables sorted by descending counts. The
+    // tables must not share words. Only the top_k words (all if 0) whose
+    // counts are at least min_count are written.
+    template <typename CharT>
+    bool write_vocab_count(const vocab_table_list<CharT> &vocab_count_list, const fs::path &output_file_name, uintmax_t top_k = 0, uintmax_t min_count = 0)
+    {
+        using EntryT = typename vocab_table<CharT>::entry;
+        std::vector<const EntryT *> sorted_entry_list;
+        size_t num_entries = 0;
+        for (auto &vocab_count : vocab_count_list) num_entries += vocab_count->size();
+        sorted_entry_list.reserve(num_entries);
+        for (auto &vocab_count : vocab_count_list)
         {
-            return x.second == y.second ? x.first < y.first : x.second > y.second;
+            vocab_count->for_each([&sorted_entry_list](const EntryT &e) { sorted_entry_list.push_back(&e); });
+        }
+        select_vocab_entries(sorted_entry_list, top_k, min_count, [](const EntryT *x, const EntryT *y)
+        {
+            return vocab_precedes(x->count, x->word, x->len, y->count, y->word, y->len);
         });
 
-        fs::basic_ofstream<CharT> out;
-        out.open(output_file_name, std::ios::out);
-        if (!out.is_open())
+        output_sink out;
+        if (!out.open(output_file_name, false, true))
         {
             std::wcerr << __wcserror(output_file_name.native().c_str());
             return false;
         }
-        out.exceptions(std::ifstream::failbit);
-        for (auto &kv : sorted_key_value)
+        for (auto e : sorted_entry_list)
         {
-            out << kv.first << '\t' << kv.second << std::endl;
+            out.write(e->word, e->len);
+            out.put<CharT>('\t');
+            out.write_number<CharT>(e->count);
+            out.put_text_new_line<CharT>();
         }
+        out.close();
         return true;
     }
 
-    template <typename CharT, typename StringT = std::basic_string<CharT>>
-    void increment_vocab_count(std::unordered_map<StringT, uintmax_t> &vocab_count, const CharT *s, size_t len)
+    template <typename CharT>
+    void increment_vocab_count(vocab_table<CharT> &vocab_count, const CharT *s, size_t len)
     {
-        StringT key(s, s + len);
-        auto it = vocab_count.find(key);
-        if (it != vocab_count.end())
-        {
-            (*it).second += 1;
-        }
-        else
-        {
-            vocab_count.emplace(std::move(key), 1);
-        }
+        vocab_count.increment(s, len);
     }
 
+    // Merges worker_table_list[worker][k] into disjoint tables by
+    // partitioning the hash space. Each partition is merged on its own
+    // thread. The worker tables are freed.
     template <typename CharT>
-    void file_count_vocab(const std::vector<fs::path> &input_file_name_list, const fs::path &output_file_name)
+    vocab_table_list<CharT> merge_vocab_tables(std::vector<vocab_table_list<CharT>> &worker_table_list, size_t k, int num_threads)
     {
-        using StringT = std::basic_string<CharT>;
-        std::unordered_map<StringT, uintmax_t> vocab_count;
-        for (auto &file_name : input_file_name_list)
+        using EntryT = typename vocab_table<CharT>::entry;
+        size_t num_workers = worker_table_list.size();
+        size_t num_partitions = static_cast<size_t>(num_threads);
+
+        // bucket_list[worker * num_partitions + partition]
+        std::vector<std::vector<const EntryT *>> bucket_list(num_workers * num_partitions);
+        parallel_for(num_workers, num_threads, [&worker_table_list, &bucket_list, k, num_partitions](size_t w)
+        {
+            auto bucket = bucket_list.begin() + w * num_partitions;
+            worker_table_list[w][k]->for_each([bucket, num_partitions](const EntryT &e)
+            {
+                bucket[static_cast<size_t>(e.hash >> 32) % num_partitions].push_back(&e);
+            });
+        });
+
+        vocab_table_list<CharT> result;
+        for (size_t p = 0; p < num_partitions; p++) result.emplace_back(new vocab_table<CharT>());
+        parallel_for(num_partitions, num_threads, [&result, &bucket_list, num_workers, num_partitions](size_t p)
         {
-            file_word_source_default<CharT>(file_name, [&vocab_count](const CharT *s, size_t len)
+            auto &table = *result[p];
+            size_t num_entries = 0;
+            for (size_t w = 0; w < num_workers; w++) num_entries += bucket_list[w * num_partitions + p].size();
+            table.reserve(num_entries);
+            for (size_t w = 0; w < num_workers; w++)
             {
-                if (s != nullptr)
+                for (auto e : bucket_list[w * num_partitions + p])
                 {
-                    increment_vocab_count(vocab_count, s, len);
+                    table.increment(e->hash, e->word, e->len, e->count);
                 }
-                return true;
-            });
-        }
+            }
+        });
 
-        write_vocab_count<CharT>(vocab_count, output_file_name);
+        for (auto &table_list : worker_table_list) table_list[k].reset();
+        return result;
     }
 
-    template <typename CharT>
-    void file_count_vocab(const std::vector<fs::path> &input_file_name_list, const vocab_output_spec &output_spec)
+    // Calls f(worker_index, k, s, len) for each word in the work items on
+    // num_threads threads, where k is the index of the column of the word
+    // in column_list. Column -1 takes the words of all columns.
+    template <typename CharT, typename F>
+    void for_each_vocab_word(const std::vector<file_work_item> &work_item_list, const std::vector<int> &column_list, int num_threads, F f)
     {
-        using StringT = std::basic_string<CharT>;
-        std::unordered_map<StringT, uintmax_t> vocab_count;
-        int target_column = output_spec.column;
+        bool all_columns_only = column_list.size() == 1 && column_list[0] == -1;
+        int all_columns_index = -1;
+        std::vector<int> column_to_index;
+        for (size_t k = 0; k < column_list.size(); k++)
+        {
+            int column = column_list[k];
+            if (column < 0)
+            {
+                all_columns_index = static_cast<int>(k);
+                continue;
+            }
+            if (column_to_index.size() <= static_cast<size_t>(column)) column_to_index.resize(column + 1, -1);
+            column_to_index[column] = static_cast<int>(k);
+        }
 
-        for (auto &file_name : input_file_name_list)
+        parallel_for_workers(work_item_list.size(), num_threads, [&](int worker_index, size_t i)
         {
-            file_word_source_with_column_default<CharT>(file_name, [&vocab_count, target_column](const CharT *s, size_t len, int column)
+            auto &item = work_item_list[i];
+            if (all_columns_only)
+            {
+                auto callback = [&f, worker_index](const CharT *s, size_t len)
+                {
+                    f(worker_index, 0, s, len);
+                };
+                if (item.size == 0)
+                {
+                    file_word_source_default<CharT>(*item.file_name, callback);
+                }
+                else
+                {
+                    file_word_source_default<CharT>(*item.file_name, item.offset, item.size, callback);
+                }
+            }
+            else
             {
-                if (s != nullptr)
+                auto callback = [&f, &column_to_index, all_columns_index, worker_index](const CharT *s, size_t len, int column)
                 {
-                    if (column == target_column)
+                    if (all_columns_index >= 0)
                     {
-                        increment_vocab_count(vocab_count, s, len);
+                        f(worker_index, all_columns_index, s, len);
                     }
+                    if (static_cast<size_t>(column) < column_to_index.size() && column_to_index[column] >= 0)
+                    {
+                        f(worker_index, column_to_index[column], s, len);
+                    }
+                };
+                if (item.size == 0)
+                {
+                    file_word_source_with_column_default<CharT>(*item.file_name, callback);
                 }
-                return true;
-            });
-        }
-
-        write_vocab_count<CharT>(vocab_count, output_spec.file_name);
+                else
+                {
+                    file_word_source_with_column_default<CharT>(*item.file_name, item.offset, item.size, callback);
+                }
+            }
+        });
     }
 
+    // Counts words for each column in column_list exactly, and writes them
+    // to the corresponding output files. The work items are counted into
+    // tables of each thread, which are merged at the end. When the tables
+    // grow beyond the memory budget in total, they are spilled to
+    // temporary files.
     template <typename CharT>
-    void file_count_vocab(const std::vector<fs::path> &input_file_name_list, const std::vector<vocab_output_spec> &output_spec_list)
+    void count_vocab_exact(const std::vector<file_work_item> &work_item_list, const std::vector<int> &column_list, const std::vector<fs::path> &output_file_name_list, int num_threads, const vocab_options &options)
     {
-        using StringT = std::basic_string<CharT>;
-        using StringCountT = std::pair<StringT, uintmax_t>;
-        std::vector<std::auto_ptr<std::unordered_map<StringT, uintmax_t>>> vocab_count_list;
-        for (auto &output_spec : output_spec_list)
+        size_t num_tables = column_list.size();
+        uintmax_t memory_budget = options.memory_budget;
+        size_t table_memory_limit = SIZE_MAX;
+        std::unique_ptr<temp_directory> temp_dir;
+        std::vector<std::unique_ptr<vocab_spill<CharT>>> spill_list(num_tables);
+        if (memory_budget != 0)
         {
-            while (vocab_count_list.size() <= output_spec.column)
+            table_memory_limit = static_cast<size_t>(std::min<uintmax_t>(SIZE_MAX, std::max<uintmax_t>(VOCAB_SPILL_MIN_TABLE_MEMORY, memory_budget / (num_threads * num_tables))));
+            temp_dir.reset(new temp_directory());
+            for (size_t k = 0; k < num_tables; k++)
             {
-                vocab_count_list.emplace_back();
+                spill_list[k].reset(new vocab_spill<CharT>(temp_dir->path() / std::to_string(k)));
             }
-            vocab_count_list[output_spec.column].reset(new std::unordered_map<StringT, uintmax_t >());
         }
 
-        for (auto &file_name : input_file_name_list)
+        std::vector<vocab_table_list<CharT>> worker_table_list(num_threads);
+        for (auto &table_list : worker_table_list)
+        {
+            for (size_t k = 0; k < num_tables; k++) table_list.emplace_back(new vocab_table<CharT>());
+        }
+
+        for_each_vocab_word<CharT>(work_item_list, column_list, num_threads, [&worker_table_list, &spill_list, table_memory_limit](int worker_index, size_t k, const CharT *s, size_t len)
         {
-            file_word_source_with_column_default<CharT>(file_name, [&vocab_count_list](const CharT *s, size_t len, int column)
+            auto &vocab_count = *worker_table_list[worker_index][k];
+            increment_vocab_count(vocab_count, s, len);
+            if (vocab_count.memory_size() > table_memory_limit)
             {
-                if (s != nullptr)
+                spill_list[k]->spill(vocab_count);
+            }
+        });
+
+        // Columns which have spilled, or whose tables would need more memory
+        // than the budget to merge, go to the spill files entirely.
+        std::vector<bool> use_spill(num_tables, false);
+        if (memory_budget != 0)
+        {
+            for (size_t k = 0; k < num_tables; k++)
+            {
+                uintmax_t table_memory_size = 0;
+                for (auto &table_list : worker_table_list) table_memory_size += table_list[k]->memory_size();
+                use_spill[k] = !spill_list[k]->empty() || (num_threads > 1 && table_memory_size * 2 > memory_budget);
+                if (use_spill[k])
                 {
-                    if (column < vocab_count_list.size())
+                    parallel_for(num_threads, num_threads, [&worker_table_list, &spill_list, k](size_t w)
                     {
-                        auto vocab_count = vocab_count_list[column].get();
-                        if (vocab_count != nullptr)
-                        {
-                            increment_vocab_count(*vocab_count, s, len);
-                        }
-                    }
+                        spill_list[k]->spill(*worker_table_list[w][k]);
+                    });
                 }
-                return true;
-            });
+            }
+        }
+
+        for (size_t k = 0; k < num_tables; k++)
+        {
+            if (use_spill[k])
+            {
+                continue;
+            }
+            if (num_threads == 1)
+            {
+                vocab_table_list<CharT> vocab_count_list;
+                vocab_count_list.push_back(std::move(worker_table_list[0][k]));
+                write_vocab_count<CharT>(vocab_count_list, output_file_name_list[k], options.top_k, options.min_count);
+            }
+            else
+            {
+                write_vocab_count<CharT>(merge_vocab_tables<CharT>(worker_table_list, k, num_threads), output_file_name_list[k], options.top_k, options.min_count);
+            }
+        }
+
+        size_t partition_memory_limit = static_cast<size_t>(std::min<uintmax_t>(SIZE_MAX, std::max<uintmax_t>(VOCAB_SPILL_MIN_TABLE_MEMORY, memory_budget / num_threads)));
+        for (size_t k = 0; k < num_tables; k++)
+        {
+            if (use_spill[k])
+            {
+                spill_list[k]->write_vocab_count(output_file_name_list[k], partition_memory_limit, num_threads, options.top_k, options.min_count);
+            }
         }
+    }
+
+    // Counts the top words for each column in column_list approximately
+    // in fixed memory, and writes them with the errors to the
+    // corresponding output files.
+    template <typename CharT>
+    void count_vocab_approximate(const std::vector<file_work_item> &work_item_list, const std::vector<int> &column_list, const std::vector<fs::path> &output_file_name_list, int num_threads, const vocab_options &options)
+    {
+        size_t num_tables = column_list.size();
+        size_t capacity = static_cast<size_t>(std::min<uintmax_t>(SIZE_MAX / SPACE_SAVING_CAPACITY_FACTOR, options.top_k)) * SPACE_SAVING_CAPACITY_FACTOR;
 
+        // worker_table_list[k][worker]
+        std::vector<std::vector<std::unique_ptr<space_saving_table<CharT>>>> worker_table_list(num_tables);
+        for (auto &table_list : worker_table_list)
+        {
+            for (int w = 0; w < num_threads; w++) table_list.emplace_back(new space_saving_table<CharT>(capacity));
+        }
+
+        for_each_vocab_word<CharT>(work_item_list, column_list, num_threads, [&worker_table_list](int worker_index, size_t k, const CharT *s, size_t len)
+        {
+            worker_table_list[k][worker_index]->increment(s, len);
+        });
+
+        for (size_t k = 0; k < num_tables; k++)
+        {
+            write_vocab_top_k<CharT>(worker_table_list[k], output_file_name_list[k], options.top_k, options.min_count);
+            worker_table_list[k].clear();
+        }
+    }
+
+    // Counts words for each column in column_list, -1 for all columns, and
+    // writes them to the corresponding output files.
+    template <typename CharT>
+    void count_vocab(const std::vector<fs::path> &input_file_name_list, const std::vector<int> &column_list, const std::vector<fs::path> &output_file_name_list, const vocab_options &options)
+    {
+        // Large files are split into line-aligned ranges when counting in
+        // parallel.
+        std::vector<file_work_item> work_item_list = split_file_work(input_file_name_list, VOCAB_RANGE_SIZE, options.num_threads > 1, options.num_threads);
+        int num_threads = static_cast<int>(std::max<size_t>(1, std::min(static_cast<size_t>(options.num_threads), work_item_list.size())));
+
+        // One table for each distinct column. Outputs of the same column
+        // are copied from the first one.
+        std::vector<int> table_column_list;
+        std::vector<std::vector<fs::path>> table_output_list;
+        for (size_t i = 0; i < column_list.size(); i++)
+        {
+            size_t k = std::find(table_column_list.begin(), table_column_list.end(), column_list[i]) - table_column_list.begin();
+            if (k == table_column_list.size())
+            {
+                table_column_list.push_back(column_list[i]);
+                table_output_list.emplace_back();
+            }
+            table_output_list[k].push_back(output_file_name_list[i]);
+        }
+
+        std::vector<fs::path> table_output_file_name_list;
+        for (auto &output_list : table_output_list) table_output_file_name_list.push_back(output_list[0]);
+        if (options.approximate)
+        {
+            count_vocab_approximate<CharT>(work_item_list, table_column_list, table_output_file_name_list, num_threads, options);
+        }
+        else
+        {
+            count_vocab_exact<CharT>(work_item_list, table_column_list, table_output_file_name_list, num_threads, options);
+        }
+
+        for (auto &output_list : table_output_list)
+        {
+            for (size_t i = 1; i < output_list.size(); i++)
+            {
+                fs::remove(output_list[i]);
+                fs::copy_file(output_list[0], output_list[i]);
+            }
+        }
+    }
+
+    template <typename CharT>
+    void file_count_vocab(const std::vector<fs::path> &input_file_name_list, const fs::path &output_file_name, const vocab_options &options = vocab_options())
+    {
+        count_vocab<CharT>(input_file_name_list, std::vector<int>{ -1 }, std::vector<fs::path>{ output_file_name }, options);
+    }
+
+    template <typename CharT>
+    void file_count_vocab(const std::vector<fs::path> &input_file_name_list, const vocab_output_spec &output_spec, const vocab_options &options = vocab_options())
+    {
+        count_vocab<CharT>(input_file_name_list, std::vector<int>{ output_spec.column }, std::vector<fs::path>{ output_spec.file_name }, options);
+    }
+
+    template <typename CharT>
+    void file_count_vocab(const std::vector<fs::path> &input_file_name_list, const std::vector<vocab_output_spec> &output_spec_list, const vocab_options &options = vocab_options())
+    {
+        std::vector<int> column_list;
+        std::vector<fs::path> output_file_name_list;
         for (auto &output_spec : output_spec_list)
         {
-            auto vocab_count = vocab_count_list[output_spec.column];
-            write_vocab_count<CharT>(*vocab_count, output_spec.file_name);
+            column_list.push_back(output_spec.column);
+            output_file_name_list.push_back(output_spec.file_name);
         }
+        count_vocab<CharT>(input_file_name_list, column_list, output_file_name_list, options);
     }
 }
\ No newline at end of file
@@ -0,0 +1,350 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+#include "vocabtable.h"
+#include "parallel.h"
+#include "outputsink.h"
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    static const int VOCAB_SPILL_PARTITION_BITS = 6;
+    static const size_t VOCAB_SPILL_PARTITIONS = static_cast<size_t>(1) << VOCAB_SPILL_PARTITION_BITS;
+    static const int VOCAB_SPILL_MAX_DEPTH = 64 / VOCAB_SPILL_PARTITION_BITS;
+    static const size_t VOCAB_SPILL_MAX_MERGE_RUNS = 128;
+    static const size_t VOCAB_SPILL_BUFFER_SIZE = 1024 * 1024;
+    static const size_t VOCAB_SPILL_MERGE_BUFFER_SIZE = 64 * 1024;
+    static const size_t VOCAB_SPILL_MIN_TABLE_MEMORY = 2 * VOCAB_ARENA_BLOCK_SIZE;
+
+    template <typename CharT>
+    struct vocab_record
+    {
+        uint64_t hash;
+        uintmax_t count;
+        std::basic_string<CharT> word;
+    };
+
+    template <typename CharT>
+    void write_vocab_record(output_sink &out, uint64_t hash, const CharT *word, size_t len, uintmax_t count)
+    {
+        uint64_t header[3] = { hash, static_cast<uint64_t>(count), static_cast<uint64_t>(len) };
+        out.write_bytes(header, sizeof(header));
+        out.write(word, len);
+    }
+
+    template <typename CharT>
+    bool read_vocab_record(std::istream &in, vocab_record<CharT> &record)
+    {
+        uint64_t header[3];
+        if (!in.read(reinterpret_cast<char *>(header), sizeof(header)))
+        {
+            if (in.gcount() != 0)
+            {
+                throw std::ios_base::failure("Truncated vocabulary spill file.");
+            }
+            return false;
+        }
+        record.hash = header[0];
+        record.count = static_cast<uintmax_t>(header[1]);
+        record.word.resize(static_cast<size_t>(header[2]));
+        if (!in.read(reinterpret_cast<char *>(&record.word[0]), record.word.size() * sizeof(CharT)))
+        {
+            throw std::ios_base::failure("Truncated vocabulary spill file.");
+        }
+        return true;
+    }
+
+    inline void open_spill_file(output_sink &out, const fs::path &file_name, bool append)
+    {
+        if (!out.open(file_name, append))
+        {
+            throw std::ios_base::failure("Cannot open vocabulary spill file.");
+        }
+    }
+
+    // Set of files which the words are appended to, partitioned by
+    // VOCAB_SPILL_PARTITION_BITS bits of the hash chosen by the depth.
+    template <typename CharT>
+    class vocab_partition_files
+    {
+    public:
+        vocab_partition_files(const fs::path &dir_name, int depth) : dir_name_(dir_name), depth_(depth), mutex_list_(VOCAB_SPILL_PARTITIONS), has_data_(false)
+        {
+            fs::create_directories(dir_name_);
+        }
+
+        int depth() const
+        {
+            return depth_;
+        }
+
+        bool empty() const
+        {
+            return !has_data_;
+        }
+
+        fs::path file_name(size_t partition) const
+        {
+            return dir_name_ / std::to_string(partition);
+        }
+
+        size_t partition_of(uint64_t hash) const
+        {
+            return static_cast<size_t>(hash >> (64 - VOCAB_SPILL_PARTITION_BITS * (depth_ + 1))) & (VOCAB_SPILL_PARTITIONS - 1);
+        }
+
+        // Appends the words in the table. This can be called from multiple
+        // threads.
+        void write(const vocab_table<CharT> &table)
+        {
+            using EntryT = typename vocab_table<CharT>::entry;
+            if (table.size() == 0)
+            {
+                return;
+            }
+
+            std::vector<std::vector<const EntryT *>> bucket_list(VOCAB_SPILL_PARTITIONS);
+            table.for_each([this, &bucket_list](const EntryT &e)
+            {
+                bucket_list[partition_of(e.hash)].push_back(&e);
+            });
+
+            for (size_t p = 0; p < VOCAB_SPILL_PARTITIONS; p++)
+            {
+                if (bucket_list[p].empty())
+                {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(mutex_list_[p]);
+                output_sink out;
+                open_spill_file(out, file_name(p), true);
+                for (auto e : bucket_list[p])
+                {
+                    write_vocab_record(out, e->hash, e->word, e->len, e->count);
+                }
+                out.close();
+            }
+            has_data_ = true;
+        }
+
+    private:
+        fs::path dir_name_;
+        int depth_;
+        std::vector<std::mutex> mutex_list_;
+        std::atomic<bool> has_data_;
+    };
+
+    // Counts of words which didn't fit in memory. Tables are spilled into
+    // hash partitioned files while counting. Each partition is aggregated
+    // into a sorted run separately, partitioning it again if it doesn't fit
+    // in memory. The runs are merged into the vocabulary file at the end.
+    template <typename CharT>
+    class vocab_spill
+    {
+    public:
+        vocab_spill(const fs::path &dir_name) : dir_name_(dir_name), partition_files_(dir_name / "p", 0), top_k_(0), min_count_(0)
+        {
+        }
+
+        vocab_spill(const vocab_spill &) = delete;
+        vocab_spill &operator=(const vocab_spill &) = delete;
+
+        bool empty() const
+        {
+            return partition_files_.empty();
+        }
+
+        // Writes the words in the table to the partition files and clears
+        // the table. This can be called from multiple threads.
+        void spill(vocab_table<CharT> &table)
+        {
+            partition_files_.write(table);
+            table.clear();
+        }
+
+        // Writes all the spilled words sorted by descending counts, using
+        // up to memory_limit bytes for each thread. Only the top_k words
+        // (all if 0) whose counts are at least min_count are written.
+        void write_vocab_count(const fs::path &output_file_name, size_t memory_limit, int num_threads, uintmax_t top_k = 0, uintmax_t min_count = 0)
+        {
+            top_k_ = top_k;
+            min_count_ = min_count;
+            parallel_for(VOCAB_SPILL_PARTITIONS, num_threads, [this, memory_limit](size_t p)
+            {
+                aggregate(partition_files_.file_name(p), 0, memory_limit);
+            });
+
+            std::vector<fs::path> run_list = std::move(run_list_);
+            std::sort(run_list.begin(), run_list.end());
+            size_t num_merges = 0;
+            while (run_list.size() > VOCAB_SPILL_MAX_MERGE_RUNS)
+            {
+                std::vector<fs::path> next_run_list;
+                for (size_t i = 0; i < run_list.size(); i += VOCAB_SPILL_MAX_MERGE_RUNS)
+                {
+                    std::vector<fs::path> group(run_list.begin() + i, run_list.begin() + std::min(run_list.size(), i + VOCAB_SPILL_MAX_MERGE_RUNS));
+                    fs::path merged_file_name = dir_name_ / ("m" + std::to_string(num_merges++));
+                    output_sink out;
+                    open_spill_file(out, merged_file_name, false);
+                    merge_runs(group, [&out](const vocab_record<CharT> &record)
+                    {
+                        write_vocab_record(out, record.hash, record.word.data(), record.word.size(), record.count);
+                    }, top_k);
+                    out.close();
+                    for (auto &file_name : group) fs::remove(file_name);
+                    next_run_list.push_back(merged_file_name);
+                }
+                run_list.swap(next_run_list);
+            }
+
+            output_sink out;
+            if (!out.open(output_file_name, false, true))
+            {
+                std::wcerr << __wcserror(output_file_name.native().c_str());
+                return;
+            }
+            merge_runs(run_list, [&out](const vocab_record<CharT> &record)
+            {
+                out.write(record.word.data(), record.word.size());
+                out.put<CharT>('\t');
+                out.write_number<CharT>(record.count);
+                out.put_text_new_line<CharT>();
+            }, top_k);
+            out.close();
+        }
+
+    private:
+        // Counts the words in a partition file and writes them to a sorted
+        // run. If they don't fit in memory_limit, the partition is split
+        // with the next bits of the hash.
+        void aggregate(const fs::path &file_name, int depth, size_t memory_limit)
+        {
+            if (!fs::exists(file_name))
+            {
+                return;
+            }
+
+            vocab_table<CharT> table;
+            std::unique_ptr<vocab_partition_files<CharT>> sub_partition_files;
+            {
+                std::unique_ptr<char[]> buffer(new char[VOCAB_SPILL_BUFFER_SIZE]);
+                fs::ifstream in;
+                in.rdbuf()->pubsetbuf(buffer.get(), VOCAB_SPILL_BUFFER_SIZE);
+                in.open(file_name, std::ios::in | std::ios::binary);
+                if (!in.is_open())
+                {
+                    throw std::ios_base::failure("Cannot open vocabulary spill file.");
+                }
+                vocab_record<CharT> record;
+                while (read_vocab_record(in, record))
+                {
+                    table.increment(record.hash, record.word.data(), record.word.size(), record.count);
+                    if (table.memory_size() > memory_limit && depth + 1 < VOCAB_SPILL_MAX_DEPTH)
+                    {
+                        if (!sub_partition_files)
+                        {
+                            sub_partition_files.reset(new vocab_partition_files<CharT>(file_name.string() + ".d", depth + 1));
+                        }
+                        sub_partition_files->write(table);
+                        table.clear();
+                    }
+                }
+            }
+            fs::remove(file_name);
+
+            if (sub_partition_files)
+            {
+                sub_partition_files->write(table);
+                table.clear();
+                for (size_t p = 0; p < VOCAB_SPILL_PARTITIONS; p++)
+                {
+                    aggregate(sub_partition_files->file_name(p), depth + 1, memory_limit);
+                }
+                return;
+            }
+
+            using EntryT = typename vocab_table<CharT>::entry;
+            std::vector<const EntryT *> sorted_entry_list;
+            sorted_entry_list.reserve(table.size());
+            table.for_each([&sorted_entry_list](const EntryT &e) { sorted_entry_list.push_back(&e); });
+            // The counts are final here as a word is only in one partition,
+            // so the words out of the top_k of this run can be dropped.
+            select_vocab_entries(sorted_entry_list, top_k_, min_count_, [](const EntryT *x, const EntryT *y)
+            {
+                return vocab_precedes(x->count, x->word, x->len, y->count, y->word, y->len);
+            });
+
+            fs::path run_file_name = file_name.string() + ".run";
+            {
+                output_sink out;
+                open_spill_file(out, run_file_name, false);
+                for (auto e : sorted_entry_list)
+                {
+                    write_vocab_record(out, e->hash, e->word, e->len, e->count);
+                }
+                out.close();
+            }
+
+            std::lock_guard<std::mutex> lock(run_list_mutex_);
+            run_list_.push_back(run_file_name);
+        }
+
+        // Calls f(const vocab_record<CharT> &) for the first top_k words
+        // (all if 0) of the sorted runs in the vocabulary order.
+        template <typename F>
+        static void merge_runs(const std::vector<fs::path> &run_list, F f, uintmax_t top_k)
+        {
+            size_t num_runs = run_list.size();
+            std::vector<std::unique_ptr<char[]>> buffer_list(num_runs);
+            std::vector<std::unique_ptr<fs::ifstream>> in_list(num_runs);
+            std::vector<vocab_record<CharT>> record_list(num_runs);
+            auto later = [&record_list](size_t x, size_t y)
+            {
+                auto &rx = record_list[x];
+                auto &ry = record_list[y];
+                return vocab_precedes(ry.count, ry.word.data(), ry.word.size(), rx.count, rx.word.data(), rx.word.size());
+            };
+            std::priority_queue<size_t, std::vector<size_t>, decltype(later)> queue(later);
+
+            for (size_t i = 0; i < num_runs; i++)
+            {
+                buffer_list[i].reset(new char[VOCAB_SPILL_MERGE_BUFFER_SIZE]);
+                in_list[i].reset(new fs::ifstream());
+                in_list[i]->rdbuf()->pubsetbuf(buffer_list[i].get(), VOCAB_SPILL_MERGE_BUFFER_SIZE);
+                in_list[i]->open(run_list[i], std::ios::in | std::ios::binary);
+                if (!in_list[i]->is_open())
+                {
+                    throw std::ios_base::failure("Cannot open vocabulary spill file.");
+                }
+                if (read_vocab_record(*in_list[i], record_list[i]))
+                {
+                    queue.push(i);
+                }
+            }
+
+            uintmax_t num_words = 0;
+            while (!queue.empty() && (top_k == 0 || num_words < top_k))
+            {
+                size_t i = queue.top();
+                queue.pop();
+                f(record_list[i]);
+                num_words++;
+                if (read_vocab_record(*in_list[i], record_list[i]))
+                {
+                    queue.push(i);
+                }
+            }
+        }
+
+        fs::path dir_name_;
+        vocab_partition_files<CharT> partition_files_;
+        std::mutex run_list_mutex_;
+        std::vector<fs::path> run_list_;
+        uintmax_t top_k_;
+        uintmax_t min_count_;
+    };
+}
\ No newline at end of file
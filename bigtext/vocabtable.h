@@ -0,0 +1,243 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+namespace bigtext
+{
+    static const size_t VOCAB_TABLE_INITIAL_CAPACITY = 1024;
+    static const size_t VOCAB_ARENA_BLOCK_SIZE = 1024 * 1024;
+
+    inline uint64_t mix_hash(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Hashes 8 bytes at a time.
+    template <typename CharT>
+    uint64_t hash_word(const CharT *s, size_t len)
+    {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(s);
+        size_t n = len * sizeof(CharT);
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+        while (n >= 8)
+        {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+            h = (h << 31) | (h >> 33);
+            p += 8;
+            n -= 8;
+        }
+        if (n > 0)
+        {
+            uint64_t w = 0;
+            std::memcpy(&w, p, n);
+            h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        }
+        return mix_hash(h);
+    }
+
+    // True if the word x comes before the word y in the vocabulary file,
+    // which is sorted by descending counts and then by words.
+    template <typename CharT>
+    bool vocab_precedes(uintmax_t x_count, const CharT *x_word, size_t x_len, uintmax_t y_count, const CharT *y_word, size_t y_len)
+    {
+        if (x_count != y_count)
+        {
+            return x_count > y_count;
+        }
+        int c = std::char_traits<CharT>::compare(x_word, y_word, std::min(x_len, y_len));
+        return c != 0 ? c < 0 : x_len < y_len;
+    }
+
+    // Sorts the entries in the vocabulary order, keeping only the first
+    // top_k entries (all if 0) whose counts are at least min_count. When
+    // top_k is smaller than the number of entries, only the kept entries
+    // are sorted after selecting them.
+    template <typename EntryPtr, typename Precedes>
+    void select_vocab_entries(std::vector<EntryPtr> &entry_list, uintmax_t top_k, uintmax_t min_count, Precedes precedes)
+    {
+        if (min_count > 1)
+        {
+            entry_list.erase(std::remove_if(entry_list.begin(), entry_list.end(), [min_count](EntryPtr e) { return e->count < min_count; }), entry_list.end());
+        }
+        if (top_k != 0 && top_k < entry_list.size())
+        {
+            auto last = entry_list.begin() + static_cast<size_t>(top_k);
+            std::nth_element(entry_list.begin(), last, entry_list.end(), precedes);
+            entry_list.erase(last, entry_list.end());
+        }
+        std::sort(entry_list.begin(), entry_list.end(), precedes);
+    }
+
+    // Counts words with open addressing and linear probing. Each slot
+    // stores the hash of the word, so that probing and growing don't need
+    // to touch the words. The words are copied into a bump arena only when
+    // they are inserted, so a hit doesn't allocate anything.
+    template <typename CharT>
+    class vocab_table
+    {
+    public:
+        struct entry
+        {
+            uint64_t hash;
+            const CharT *word;
+            uintmax_t count;
+            size_t len;
+        };
+
+        vocab_table() : size_(0), arena_used_(0), arena_memory_size_(0)
+        {
+            slot_list_.resize(VOCAB_TABLE_INITIAL_CAPACITY);
+        }
+
+        vocab_table(const vocab_table &) = delete;
+        vocab_table &operator=(const vocab_table &) = delete;
+
+        void increment(const CharT *s, size_t len, uintmax_t count = 1)
+        {
+            increment(hash_word(s, len), s, len, count);
+        }
+
+        void increment(uint64_t hash, const CharT *s, size_t len, uintmax_t count)
+        {
+            size_t mask = slot_list_.size() - 1;
+            size_t i = static_cast<size_t>(hash) & mask;
+            while (true)
+            {
+                entry &e = slot_list_[i];
+                if (e.word == nullptr)
+                {
+                    if ((size_ + 1) * 10 > slot_list_.size() * 7)
+                    {
+                        grow();
+                        increment(hash, s, len, count);
+                        return;
+                    }
+                    e.hash = hash;
+                    e.word = intern(s, len);
+                    e.len = len;
+                    e.count = count;
+                    size_++;
+                    return;
+                }
+                if (e.hash == hash && e.len == len && std::char_traits<CharT>::compare(e.word, s, len) == 0)
+                {
+                    e.count += count;
+                    return;
+                }
+                i = (i + 1) & mask;
+            }
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        // Makes room for num_words words without growing.
+        void reserve(size_t num_words)
+        {
+            size_t capacity = slot_list_.size();
+            while (num_words * 10 >= capacity * 7)
+            {
+                capacity *= 2;
+            }
+            if (capacity != slot_list_.size())
+            {
+                rehash(capacity);
+            }
+        }
+
+        // Approximate number of bytes used by the slots and the words.
+        size_t memory_size() const
+        {
+            return slot_list_.size() * sizeof(entry) + arena_memory_size_;
+        }
+
+        // Calls f(const entry &) for each word in no particular order.
+        template <typename F>
+        void for_each(F f) const
+        {
+            for (auto &e : slot_list_)
+            {
+                if (e.word != nullptr)
+                {
+                    f(e);
+                }
+            }
+        }
+
+        void clear()
+        {
+            std::vector<entry>(VOCAB_TABLE_INITIAL_CAPACITY).swap(slot_list_);
+            arena_list_.clear();
+            large_word_list_.clear();
+            arena_used_ = 0;
+            arena_memory_size_ = 0;
+            size_ = 0;
+        }
+
+    private:
+        void grow()
+        {
+            rehash(slot_list_.size() * 2);
+        }
+
+        void rehash(size_t capacity)
+        {
+            std::vector<entry> new_slot_list(capacity);
+            size_t mask = new_slot_list.size() - 1;
+            for (auto &e : slot_list_)
+            {
+                if (e.word != nullptr)
+                {
+                    size_t i = static_cast<size_t>(e.hash) & mask;
+                    while (new_slot_list[i].word != nullptr)
+                    {
+                        i = (i + 1) & mask;
+                    }
+                    new_slot_list[i] = e;
+                }
+            }
+            slot_list_.swap(new_slot_list);
+        }
+
+        const CharT *intern(const CharT *s, size_t len)
+        {
+            if (len > VOCAB_ARENA_BLOCK_SIZE / 4)
+            {
+                // A long word gets its own block, so that the current
+                // block is kept for the next words.
+                large_word_list_.emplace_back(new CharT[len]);
+                std::copy(s, s + len, large_word_list_.back().get());
+                arena_memory_size_ += len * sizeof(CharT);
+                return large_word_list_.back().get();
+            }
+            if (arena_list_.empty() || arena_used_ + len > VOCAB_ARENA_BLOCK_SIZE)
+            {
+                arena_list_.emplace_back(new CharT[VOCAB_ARENA_BLOCK_SIZE]);
+                arena_used_ = 0;
+                arena_memory_size_ += VOCAB_ARENA_BLOCK_SIZE * sizeof(CharT);
+            }
+            CharT *p = arena_list_.back().get() + arena_used_;
+            std::copy(s, s + len, p);
+            arena_used_ += len;
+            return p;
+        }
+
+        std::vector<entry> slot_list_;
+        size_t size_;
+        std::vector<std::unique_ptr<CharT[]>> arena_list_;
+        std::vector<std::unique_ptr<CharT[]>> large_word_list_;
+        size_t arena_used_;
+        size_t arena_memory_size_;
+    };
+}
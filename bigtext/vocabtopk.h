@@ -0,0 +1,267 @@
+/* bigtext - bigtext is a collection of tools to process large text files.
+* Copyright (C) 2018 Katsuya Iida. All rights reserved.
+*/
+
+#pragma once
+
+#include "vocabtable.h"
+#include "outputsink.h"
+
+namespace bigtext
+{
+    namespace fs = boost::filesystem;
+
+    // Number of counters kept for each of the top K words.
+    static const size_t SPACE_SAVING_CAPACITY_FACTOR = 2;
+
+    // Approximate counts of the most frequent words in fixed memory with
+    // the SpaceSaving algorithm. When all the counters are in use, a new
+    // word takes over the counter with the minimum count. Each counter
+    // keeps the count it took over as the error, so the true count of the
+    // word is between count - error and count. A word which is more
+    // frequent than 1 / capacity of all the words is always kept.
+    template <typename CharT>
+    class space_saving_table
+    {
+    public:
+        struct counter
+        {
+            uint64_t hash;
+            std::basic_string<CharT> word;
+            uintmax_t count;
+            uintmax_t error;
+            size_t heap_index;
+        };
+
+        explicit space_saving_table(size_t capacity) : capacity_(std::max<size_t>(1, capacity))
+        {
+            size_t slot_count = 1;
+            while (slot_count < capacity_ * 2) slot_count *= 2;
+            slot_list_.resize(slot_count, 0);
+            counter_list_.reserve(capacity_);
+            heap_.reserve(capacity_);
+        }
+
+        space_saving_table(const space_saving_table &) = delete;
+        space_saving_table &operator=(const space_saving_table &) = delete;
+
+        void increment(const CharT *s, size_t len)
+        {
+            increment(hash_word(s, len), s, len, 1, 0);
+        }
+
+        void increment(uint64_t hash, const CharT *s, size_t len, uintmax_t count, uintmax_t error)
+        {
+            size_t i = find_slot(hash, s, len);
+            if (slot_list_[i] != 0)
+            {
+                counter &c = counter_list_[slot_list_[i] - 1];
+                c.count += count;
+                c.error += error;
+                sift_down(c.heap_index);
+                return;
+            }
+
+            if (counter_list_.size() < capacity_)
+            {
+                counter_list_.push_back(counter{ hash, std::basic_string<CharT>(s, len), count, error, heap_.size() });
+                heap_.push_back(counter_list_.size() - 1);
+                slot_list_[i] = counter_list_.size();
+                sift_up(heap_.size() - 1);
+                return;
+            }
+
+            // Take over the counter with the minimum count.
+            size_t index = heap_[0];
+            counter &c = counter_list_[index];
+            erase_slot(find_slot(c.hash, c.word.data(), c.word.size()));
+            c.hash = hash;
+            c.word.assign(s, len);
+            c.error = c.count + error;
+            c.count += count;
+            slot_list_[find_slot(hash, s, len)] = index + 1;
+            sift_down(0);
+        }
+
+        // Upper bound of the counts of the words not in the table.
+        uintmax_t min_count() const
+        {
+            return counter_list_.size() < capacity_ ? 0 : counter_list_[heap_[0]].count;
+        }
+
+        size_t size() const
+        {
+            return counter_list_.size();
+        }
+
+        // Calls f(const counter &) for each word in no particular order.
+        template <typename F>
+        void for_each(F f) const
+        {
+            for (auto &c : counter_list_) f(c);
+        }
+
+        // Adds the counts of another table. The counts stay upper bounds:
+        // words missing in the other table get its minimum count.
+        void merge(const space_saving_table &other)
+        {
+            uintmax_t other_min_count = other.min_count();
+            if (other_min_count > 0)
+            {
+                for (auto &c : counter_list_)
+                {
+                    if (other.slot_list_[other.find_slot(c.hash, c.word.data(), c.word.size())] == 0)
+                    {
+                        c.count += other_min_count;
+                        c.error += other_min_count;
+                    }
+                }
+                for (size_t i = heap_.size() / 2; i-- > 0;)
+                {
+                    sift_down(i);
+                }
+            }
+            for (auto &c : other.counter_list_)
+            {
+                increment(c.hash, c.word.data(), c.word.size(), c.count, c.error);
+            }
+        }
+
+    private:
+        // Returns the slot of the word, or the empty slot to insert it.
+        size_t find_slot(uint64_t hash, const CharT *s, size_t len) const
+        {
+            size_t mask = slot_list_.size() - 1;
+            size_t i = static_cast<size_t>(hash) & mask;
+            while (slot_list_[i] != 0)
+            {
+                const counter &c = counter_list_[slot_list_[i] - 1];
+                if (c.hash == hash && c.word.size() == len && std::char_traits<CharT>::compare(c.word.data(), s, len) == 0)
+                {
+                    break;
+                }
+                i = (i + 1) & mask;
+            }
+            return i;
+        }
+
+        // Removes the slot shifting back the following slots, so that
+        // linear probing doesn't need tombstones.
+        void erase_slot(size_t i)
+        {
+            size_t mask = slot_list_.size() - 1;
+            size_t j = i;
+            while (true)
+            {
+                slot_list_[i] = 0;
+                while (true)
+                {
+                    j = (j + 1) & mask;
+                    if (slot_list_[j] == 0)
+                    {
+                        return;
+                    }
+                    size_t home = static_cast<size_t>(counter_list_[slot_list_[j] - 1].hash) & mask;
+                    // Move the slot j to i unless its home is in (i, j].
+                    if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                    {
+                        continue;
+                    }
+                    break;
+                }
+                slot_list_[i] = slot_list_[j];
+                i = j;
+            }
+        }
+
+        bool heap_less(size_t x, size_t y) const
+        {
+            return counter_list_[heap_[x]].count < counter_list_[heap_[y]].count;
+        }
+
+        void heap_swap(size_t x, size_t y)
+        {
+            std::swap(heap_[x], heap_[y]);
+            counter_list_[heap_[x]].heap_index = x;
+            counter_list_[heap_[y]].heap_index = y;
+        }
+
+        void sift_up(size_t i)
+        {
+            while (i > 0)
+            {
+                size_t parent = (i - 1) / 2;
+                if (!heap_less(i, parent))
+                {
+                    break;
+                }
+                heap_swap(i, parent);
+                i = parent;
+            }
+        }
+
+        void sift_down(size_t i)
+        {
+            size_t n = heap_.size();
+            while (true)
+            {
+                size_t smallest = i;
+                size_t left = i * 2 + 1;
+                size_t right = left + 1;
+                if (left < n && heap_less(left, smallest)) smallest = left;
+                if (right < n && heap_less(right, smallest)) smallest = right;
+                if (smallest == i)
+                {
+                    break;
+                }
+                heap_swap(i, smallest);
+                i = smallest;
+            }
+        }
+
+        size_t capacity_;
+        std::vector<counter> counter_list_;
+        std::vector<size_t> heap_;
+        std::vector<size_t> slot_list_; // Index of the counter + 1. 0 for empty.
+    };
+
+    // Writes the top_k words of the tables sorted by descending counts
+    // with the errors. The first table is merged with the others.
+    template <typename CharT>
+    bool write_vocab_top_k(std::vector<std::unique_ptr<space_saving_table<CharT>>> &table_list, const fs::path &output_file_name, uintmax_t top_k, uintmax_t min_count)
+    {
+        using CounterT = typename space_saving_table<CharT>::counter;
+        auto &table = *table_list[0];
+        for (size_t i = 1; i < table_list.size(); i++)
+        {
+            table.merge(*table_list[i]);
+            table_list[i].reset();
+        }
+
+        std::vector<const CounterT *> sorted_counter_list;
+        sorted_counter_list.reserve(table.size());
+        table.for_each([&sorted_counter_list](const CounterT &c) { sorted_counter_list.push_back(&c); });
+        select_vocab_entries(sorted_counter_list, top_k, min_count, [](const CounterT *x, const CounterT *y)
+        {
+            return vocab_precedes(x->count, x->word.data(), x->word.size(), y->count, y->word.data(), y->word.size());
+        });
+
+        output_sink out;
+        if (!out.open(output_file_name, false, true))
+        {
+            std::wcerr << __wcserror(output_file_name.native().c_str());
+            return false;
+        }
+        for (auto c : sorted_counter_list)
+        {
+            out.write(c->word.data(), c->word.size());
+            out.put<CharT>('\t');
+            out.write_number<CharT>(c->count);
+            out.put<CharT>('\t');
+            out.write_number<CharT>(c->error);
+            out.put_text_new_line<CharT>();
+        }
+        out.close();
+        return true;
+    }
+}
\ No newline at end of file
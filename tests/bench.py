@@ -0,0 +1,72 @@
+# -*- coding: utf-8 -*-
+
+# Measures the per-token and per-line cost of bigtext commands.
+#
+# usage: python bench.py BIGTEXT_EXE [BIGTEXT_EXE...]
+#
+# Pass the binaries before and after a change to compare them. The input
+# has a small vocabulary, so that the cost of the scan loop and the
+# callbacks is not hidden by cache misses of the vocabulary table.
+
+import os
+import re
+import subprocess
+import sys
+import random
+
+BENCH_FILE = 'bench.txt'
+NUM_LINES = 2000000
+WORDS = ['w%d' % i for i in range(100)]
+OUTPUT_FILE = 'bench_result.txt'
+NUM_RUNS = 3
+
+wall_pat = re.compile(r'([0-9.]+)s wall')
+
+def generate():
+    random.seed(1)
+    num_tokens = 0
+    with open(BENCH_FILE, 'w') as f:
+        for _ in range(NUM_LINES):
+            n = random.randrange(1, 21)
+            num_tokens += n
+            f.write(' '.join(random.choice(WORDS) for _ in range(n)) + '\n')
+    return num_tokens
+
+def count_tokens():
+    with open(BENCH_FILE, 'rb') as f:
+        return len(f.read().split())
+
+def run(exe, args):
+    best = None
+    for _ in range(NUM_RUNS):
+        if os.path.exists(OUTPUT_FILE):
+            os.unlink(OUTPUT_FILE)
+        output = subprocess.getoutput(' '.join([exe] + args))
+        m = wall_pat.search(output)
+        if m is None:
+            raise ValueError(output)
+        t = float(m.group(1))
+        if best is None or t < best:
+            best = t
+    return best
+
+def main():
+    if len(sys.argv) < 2:
+        print('usage: python bench.py BIGTEXT_EXE [BIGTEXT_EXE...]')
+        return 1
+    if os.path.exists(BENCH_FILE):
+        num_tokens = count_tokens()
+    else:
+        num_tokens = generate()
+    num_lines = NUM_LINES
+    for exe in sys.argv[1:]:
+        t = run(exe, ['vocab', BENCH_FILE, '-o', OUTPUT_FILE])
+        print('%s\tvocab\t%.2f ns/token' % (exe, t * 1e9 / num_tokens))
+        t = run(exe, ['sample', BENCH_FILE, '-r', '0.5', OUTPUT_FILE])
+        print('%s\tsample\t%.2f ns/line' % (exe, t * 1e9 / num_lines))
+    if os.path.exists(OUTPUT_FILE):
+        os.unlink(OUTPUT_FILE)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
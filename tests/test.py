@@ -4,6 +4,8 @@ import subprocess
 from collections import Counter
 import re
 import ast
+import math
+import shutil
 import logging
 
 logging.basicConfig(level=logging.INFO)
@@ -21,6 +23,8 @@ class TestBigtext(unittest.TestCase):
 
     FILES = ['shakespeare.txt'] + ['test%d.txt' % i for i in range(1, 8)]
     OUTPUT_FILES = ['result.txt', 'result2.txt']
+    # Values of BIGTEXT_SIMD, which limits the scanning kernels.
+    SIMD_LEVELS = ['scalar', 'sse2', 'avx2', 'avx512']
 
     @classmethod
     def tearDownClass(cls):
@@ -39,16 +43,209 @@ class TestBigtext(unittest.TestCase):
             self._run_command('count %s' % source_fname)
             self.assertFileIsCountedFrom(source_fname, False)
 
+    def test_count_quick_large(self):
+        # Larger files are estimated from blocks. Short and long lines
+        # are in different parts of the file.
+        fname = 'large.txt'
+        try:
+            with open(fname, 'w') as f:
+                for i in range(1000000):
+                    f.write('%d\n' % i)
+                for i in range(100000):
+                    f.write('%d\n' % (i * 10 ** 100))
+            self._run_command('count %s' % fname)
+            res = self.parsed_result[fname]
+            expected_len = count_lines(fname)
+            logging.info("%d lines estimated in [%d, %d], expected %d lines.", res['EstLineCount'], res['EstLineCountLow'], res['EstLineCountHigh'], expected_len)
+            self.assertLess(abs(res['EstLineCount'] / expected_len - 1), .1)
+            self.assertLessEqual(res['EstLineCountLow'], expected_len)
+            self.assertGreaterEqual(res['EstLineCountHigh'], expected_len)
+        finally:
+            if os.path.exists(fname):
+                os.unlink(fname)
+
     def test_count_full(self):
         for source_fname in self.FILES:
             self._run_command('count -c %s' % source_fname)
             self.assertFileIsCountedFrom(source_fname, True)
 
+    def test_count_full_threads(self):
+        for source_fname in self.FILES:
+            self._run_command('count -c -t 4 %s' % source_fname)
+            self.assertFileIsCountedFrom(source_fname, True)
+
+    def test_count_ranges(self):
+        # Small ranges split the files into many ranges on the threads,
+        # which give the same counts as one thread. Each kernel is tested
+        # with one range size, and avx512 is the best kernel of the CPU.
+        for opt in ['-c ', '-c -l ', '-w ']:
+            for source_fname in ['shakespeare.txt', 'test2.txt', 'test6.txt', 'test7.txt']:
+                self._run_command('count %s-t 1 %s' % (opt, source_fname))
+                expected = [y for y in self.command_result.split('\n') if y.startswith(source_fname + '\t')]
+                self.assertTrue(expected)
+                for range_size, simd in [('4099', 'avx512'), ('1048576', 'avx512')] + [('65536', simd) for simd in self.SIMD_LEVELS]:
+                    self._run_command('count %s-t 3 %s' % (opt, source_fname), {'BIGTEXT_RANGE_SIZE': range_size, 'BIGTEXT_SIMD': simd})
+                    actual = [y for y in self.command_result.split('\n') if y.startswith(source_fname + '\t')]
+                    self.assertEqual(actual, expected)
+
+    def test_index(self):
+        try:
+            for source_fname in self.FILES:
+                self._run_command('index %s' % source_fname)
+                self.assertFileIsCountedFrom(source_fname, True)
+                self._run_command('count -c %s' % source_fname)
+                self.assertFileIsCountedFrom(source_fname, True)
+                if source_fname in ['shakespeare.txt', 'test1.txt', 'test3.txt', 'test6.txt', 'test7.txt']:
+                    self._run_command('sample -s -c 1 %s -o result.txt' % source_fname)
+                    self.assertFileIsShuffledFrom('result.txt', source_fname)
+        finally:
+            for source_fname in self.FILES:
+                if os.path.exists(source_fname + '.btidx'):
+                    os.unlink(source_fname + '.btidx')
+
+    def test_index_stale(self):
+        # The file is rewritten with the same size and write time as the
+        # index, so the index looks up to date but its offsets are not.
+        with open('stale.txt', 'wb') as f:
+            f.write(b'aaaaa\naaa\nbbbb\n')
+        try:
+            self._run_command('index stale.txt')
+            st = os.stat('stale.txt')
+            with open('stale.txt', 'wb') as f:
+                f.write(b'bbbbbbb\naaaaaa\n')
+            os.utime('stale.txt', ns=(st.st_atime_ns, st.st_mtime_ns))
+            for opt in ['-s -c 1 stale.txt -o result.txt', '-q stale.txt -n 20 result.txt']:
+                self._run_command('sample %s' % opt)
+                self.assertLessEqual(set(read_sample('result.txt')), {b'bbbbbbb\n', b'aaaaaa\n'})
+        finally:
+            for fname in ['stale.txt', 'stale.txt.btidx']:
+                if os.path.exists(fname):
+                    os.unlink(fname)
+
+    def test_input_specs(self):
+        os.makedirs(os.path.join('inputs', 'sub'))
+        file_list = [os.path.join('inputs', 'part%d.txt' % i) for i in range(3)] + [os.path.join('inputs', 'sub', 'part3.txt')]
+        lines = read_sample('shakespeare.txt')
+        for i, fname in enumerate(file_list):
+            with open(fname, 'wb') as f:
+                f.write(b''.join(lines[:i * 10 + 5]))
+        with open('inputs.lst', 'w') as f:
+            f.write('%s\n%s\n' % (file_list[3], file_list[0]))
+        try:
+            # The index file in the directory is not an input.
+            self._run_command('index %s' % file_list[0])
+            for spec, expected in [('inputs', [0, 1, 2, 3]), ('"inputs/part*.txt"', [0, 1, 2]), ('"inputs/*/part?.txt" @inputs.lst', [3, 3, 0])]:
+                self._run_command('count -c %s' % spec)
+                counts = [int(y.split('\t')[2]) for y in self.command_result.split('\n') if '\tLineCount\t' in y]
+                self.assertEqual(counts, [i * 10 + 5 for i in expected])
+        finally:
+            shutil.rmtree('inputs')
+            os.remove('inputs.lst')
+
+    def test_count_line_size(self):
+        for opt in ['', '-c ', '-c -t 3 ']:
+            for source_fname in ['shakespeare.txt', 'test1.txt', 'test7.txt']:
+                self._run_command('count -l %s%s' % (opt, source_fname))
+                res = self.parsed_result[source_fname]
+                sizes = sorted(len(x) for x in read_sample(source_fname))
+                tokens = sorted(len(x.split()) for x in read_sample(source_fname))
+                for name, q in [('P50', .5), ('P90', .9), ('P99', .99), ('P999', .999)]:
+                    # The values are the upper bounds of the buckets.
+                    expected = sizes[max(1, math.ceil(q * len(sizes))) - 1]
+                    self.assertGreaterEqual(res['LineSize' + name], expected)
+                    self.assertLessEqual(res['LineSize' + name], expected * 17 / 16)
+                    expected = tokens[max(1, math.ceil(q * len(tokens))) - 1]
+                    self.assertGreaterEqual(res['TokenCount' + name], expected)
+                    self.assertLessEqual(res['TokenCount' + name], expected * 17 / 16)
+                histogram = [y.split('\t') for y in self.command_result.split('\n') if '\tLineSizeHistogram\t' in y]
+                self.assertEqual(len(sizes), sum(int(y[3]) for y in histogram))
+
+    def test_count_many_files(self):
+        file_list = ['shard%02d.txt' % i for i in range(20)]
+        lines = read_sample('shakespeare.txt')
+        for i, fname in enumerate(file_list):
+            with open(fname, 'wb') as f:
+                f.write(b''.join(lines[i * 97:i * 97 + i * 31]))
+        try:
+            for opt in ['-c ', '-w ', '']:
+                self._run_command('count %s-t 3 %s' % (opt, ' '.join(file_list)))
+                names = []
+                for y in self.command_result.split('\n'):
+                    name = y.split('\t')[0]
+                    if '\t' in y and name not in names:
+                        names.append(name)
+                # -w also outputs the total without the file name.
+                self.assertEqual(names, file_list + [''] if opt == '-w ' else file_list)
+                for i, fname in enumerate(file_list):
+                    key = 'EstLineCount' if opt == '' else 'LineCount'
+                    self.assertEqual(self.parsed_result[fname][key], i * 31)
+        finally:
+            for fname in file_list:
+                os.remove(fname)
+
+    def test_count_text(self):
+        with open('malformed.txt', 'wb') as f:
+            f.write(b'caf\xc3\xa9 \xff\xe3\x81 x\xed\xa0\x80y\n\xf0\x9f\x98\x80 \xc0\xaf\t\xe6\x97')
+        try:
+            for opt, simd in [(opt, simd) for opt in ['', '-t 3 '] for simd in self.SIMD_LEVELS]:
+                for source_fname in ['shakespeare.txt', 'test2.txt', 'test6.txt', 'malformed.txt']:
+                    self._run_command('count -w %s%s' % (opt, source_fname), {'BIGTEXT_SIMD': simd})
+                    res = self.parsed_result[source_fname]
+                    with open(source_fname, 'rb') as f:
+                        data = f.read()
+                    text = data.decode('utf-8', 'replace')
+                    self.assertEqual(res['ByteCount'], len(data))
+                    self.assertEqual(res['LineCount'], len(data.splitlines()))
+                    self.assertEqual(res['WordCount'], len(data.split()))
+                    self.assertEqual(res['CharCount'], len(text))
+                    self.assertEqual(res['MalformedCount'], text.count('\ufffd'))
+        finally:
+            os.remove('malformed.txt')
+
     def test_vocab(self):
         for source_fname in self.FILES:
             self._run_command('vocab %s -o result.txt' % source_fname)
             self.assertFileIsVocabOf('result.txt', source_fname)
 
+    def test_vocab_threads(self):
+        for source_fname in self.FILES:
+            self._run_command('vocab -t 4 %s -o result.txt' % source_fname)
+            self.assertFileIsVocabOf('result.txt', source_fname)
+
+    def test_vocab_simd(self):
+        for source_fname in ['shakespeare.txt', 'test6.txt', 'test7.txt']:
+            outputs = []
+            for simd in self.SIMD_LEVELS:
+                self._run_command('vocab -t 3 %s -o result.txt' % source_fname, {'BIGTEXT_SIMD': simd})
+                self.assertFileIsVocabOf('result.txt', source_fname)
+                with open('result.txt', 'rb') as f:
+                    outputs.append(f.read())
+            self.assertEqual(outputs, [outputs[0]] * len(outputs))
+
+    def test_vocab_memory_budget(self):
+        for source_fname in self.FILES:
+            self._run_command('vocab -M 1 %s -o result.txt' % source_fname)
+            self.assertFileIsVocabOf('result.txt', source_fname)
+
+    def test_vocab_top_k(self):
+        for source_fname in self.FILES:
+            self._run_command('vocab -k 100 -m 2 %s -o result.txt' % source_fname)
+            self.assertFileIsVocabOf('result.txt', source_fname)
+            actual = read_vocab('result.txt')
+            expected = [k for k, v in get_vocab(source_fname).items() if v >= 2]
+            self.assertEqual(len(actual), min(100, len(expected)))
+            self.assertTrue(all(v >= 2 for v in actual.values()))
+
+    def test_vocab_approximate(self):
+        for source_fname in self.FILES:
+            self._run_command('vocab -a -k 100 %s -o result.txt' % source_fname)
+            expected = get_vocab(source_fname)
+            with open('result.txt', 'rb') as f:
+                for x in f.readlines():
+                    word, count, error = x.rstrip(b'\r\n').split(b'\t')
+                    count, error = int(count), int(error)
+                    self.assertTrue(count - error <= expected[word] <= count)
+
     def test_sample_single_all(self):
         for source_fname in self.FILES:
             self._run_command('sample %s -o result.txt' % source_fname)
@@ -62,7 +259,14 @@ class TestBigtext(unittest.TestCase):
     def test_sample_single_num(self):
         for source_fname in self.FILES:
             self._run_command('sample %s -n 1000 result.txt' % source_fname)
-            self.assertFileIsSampledFrom('result.txt', source_fname, 1000, False)
+            self.assertFileIsSampledFrom('result.txt', source_fname, 1000, True)
+
+    def test_sample_double_num(self):
+        for source_fname in self.FILES:
+            self._run_command('sample %s -n 1000 result.txt -n 500 result2.txt' % source_fname)
+            self.assertFileIsSampledFrom('result.txt', source_fname, 1000, True)
+            if count_lines(source_fname) >= 1500:
+                self.assertFileIsSampledFrom('result2.txt', source_fname, 500, True)
 
     def test_sample_double_num_rate(self):
         for source_fname in self.FILES:
@@ -93,6 +297,54 @@ class TestBigtext(unittest.TestCase):
                 self.assertFileIsSampledFrom('result.txt', source_fname, 0, True)
                 self.assertFileIsShuffledFrom('result.txt', source_fname)
 
+    def test_shuffle_threads(self):
+        for opt in ['-s -c 1 -t 3 ', '-s -c 3 -t 3 ']:
+            for source_fname in ['shakespeare.txt', 'test1.txt']:
+                self._run_command('sample %s%s -o result.txt' % (opt, source_fname))
+                self.assertFileIsSampledFrom('result.txt', source_fname, 0, True)
+                self.assertFileIsShuffledFrom('result.txt', source_fname)
+
+    def test_sample_seed(self):
+        for opt, opt2 in [('', '-r 10% result.txt'), ('-s -c 1 -t 1 ', '-o result.txt'), ('-s -c 1 -t 3 ', '-o result.txt'), ('-s -c 3 ', '-o result.txt')]:
+            self._run_command('sample --seed 7 %sshakespeare.txt %s' % (opt, opt2))
+            with open('result.txt', 'rb') as f:
+                expected = f.read()
+            self._run_command('sample --seed 7 -t 2 %sshakespeare.txt %s' % (opt.replace('-t 1 ', '').replace('-t 3 ', ''), opt2))
+            with open('result.txt', 'rb') as f:
+                self.assertEqual(f.read(), expected)
+
+    def test_sample_low_rate(self):
+        # Low rates skip the lines between the samples, which gives the
+        # same lines on any number of threads with a seed.
+        for opt2 in ['-r 0.5% result.txt', '-r 0.5% result.txt -r 0.5% result2.txt']:
+            for source_fname in ['shakespeare.txt', 'test1.txt', 'test2.txt']:
+                outputs = []
+                for threads in ['1', '3']:
+                    self._run_command('sample --seed 7 -t %s %s %s' % (threads, source_fname, opt2))
+                    output_fnames = self.OUTPUT_FILES[:opt2.count('-r')]
+                    # The smaller files have too few samples for the tolerance.
+                    if source_fname == 'shakespeare.txt':
+                        for output_fname in output_fnames:
+                            self.assertFileIsSampledFrom(output_fname, source_fname, 0.005, False)
+                    if len(output_fnames) == 2:
+                        source = Counter(read_sample(source_fname))
+                        actual = Counter(read_sample('result.txt')) + Counter(read_sample('result2.txt'))
+                        self.assertLessEqual(actual - source, Counter())
+                    contents = []
+                    for output_fname in output_fnames:
+                        with open(output_fname, 'rb') as f:
+                            contents.append(f.read())
+                    outputs.append(contents)
+                self.assertEqual(outputs[0], outputs[1])
+
+    def test_sample_quick_multiple_files(self):
+        self._run_command('sample -q test1.txt test4.txt test7.txt -n 300 result.txt')
+        actual = read_sample('result.txt')
+        self.assertEqual(300, len(actual))
+        source = set(read_sample('test1.txt')) | set(read_sample('test7.txt'))
+        self.assertLessEqual(set(actual), source)
+        self.assertSampleLinesAreCorrect('result.txt')
+
     def test_shuffle_single_num_rate(self):
         for opt in ['-s ', '-s -c 3 ']:
             for source_fname in ['shakespeare.txt', 'test1.txt', 'test3.txt', 'test6.txt', 'test7.txt']:
@@ -195,10 +447,19 @@ class TestBigtext(unittest.TestCase):
         source.sort()
         self.assertSequenceEqual(source, actual)
 
-    def _run_command(self, args=[]):
+    def _run_command(self, args=[], env={}):
         self._remove_output()
-        logging.info("Running command with `%s'.", args)
-        self.command_result = exec_command(args)
+        logging.info("Running command with `%s' %s.", args, env)
+        saved_env = {k: os.environ.get(k) for k in env}
+        os.environ.update(env)
+        try:
+            self.command_result = exec_command(args)
+        finally:
+            for k, v in saved_env.items():
+                if v is None:
+                    del os.environ[k]
+                else:
+                    os.environ[k] = v
         self.parsed_result = parse_triple(self.command_result)
 
     @classmethod